@@ -0,0 +1,39 @@
+# CMake helpers for projects using ObjectiveLua. Include this file after the
+# Lua library has been found, i.e. LUA_INCLUDE_DIR and LUA_LIBRARIES are set.
+
+set(OBJLUA_CMAKE_DIR ${CMAKE_CURRENT_LIST_DIR})
+
+# objlua_embed_scripts(<target> [BASE_DIR <dir>] SCRIPTS <file>...)
+#
+# Precompiles the given Lua scripts to bytecode at build time and links them
+# into the target as constant arrays. At runtime LuaState::dofile, dofile and
+# require find the scripts under their path relative to BASE_DIR, which
+# defaults to the current source directory, without reading any files.
+function(objlua_embed_scripts target)
+	cmake_parse_arguments(EMBED "" "BASE_DIR" "SCRIPTS" ${ARGN})
+	if(NOT EMBED_BASE_DIR)
+		set(EMBED_BASE_DIR ${CMAKE_CURRENT_SOURCE_DIR})
+	endif()
+	get_filename_component(EMBED_BASE_DIR ${EMBED_BASE_DIR} ABSOLUTE)
+
+	# The compiler tool is built once for all targets.
+	if(NOT TARGET objlua_embed)
+		add_executable(objlua_embed ${OBJLUA_CMAKE_DIR}/embed.cpp)
+		target_include_directories(objlua_embed PRIVATE ${LUA_INCLUDE_DIR})
+		target_link_libraries(objlua_embed ${LUA_LIBRARIES})
+	endif()
+
+	set(scripts)
+	foreach(script ${EMBED_SCRIPTS})
+		get_filename_component(script ${script} ABSOLUTE)
+		list(APPEND scripts ${script})
+	endforeach()
+
+	set(output ${CMAKE_CURRENT_BINARY_DIR}/${target}_scripts.cpp)
+	add_custom_command(
+		OUTPUT ${output}
+		COMMAND objlua_embed ${output} ${EMBED_BASE_DIR} ${scripts}
+		DEPENDS objlua_embed ${scripts}
+		COMMENT "Embedding Lua scripts into ${target}")
+	target_sources(${target} PRIVATE ${output})
+endfunction()
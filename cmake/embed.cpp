@@ -0,0 +1,111 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+}
+
+using namespace std;
+
+
+/** Compiles Lua scripts and writes a C++ source embedding the chunks, which
+ registers them with LuaEmbedded.
+ 
+ Usage: objlua_embed <output.cpp> <base directory> <script>... */
+
+/** Writer passed to lua_dump which appends to a string. */
+static int writer(lua_State * L, const void * p, size_t size, void * ud)
+{
+	((string *)ud)->append((const char *)p, size);
+	return 0;
+}
+
+/** Returns the path relative to the base directory. */
+static string relative(const string & path, const string & base)
+{
+	string prefix = base;
+	if (!prefix.empty() && prefix[prefix.size() - 1] != '/')
+		prefix += '/';
+	if (path.compare(0, prefix.size(), prefix) == 0)
+		return path.substr(prefix.size());
+	return path;
+}
+
+/** Reads the given file into a string. */
+static bool read(const char * path, string & content)
+{
+	FILE * f = fopen(path, "rb");
+	if (!f)
+		return false;
+	char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+		content.append(buffer, n);
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+
+int main(int argc, char * argv[])
+{
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <output.cpp> <base directory> <script>...\n", argv[0]);
+		return 1;
+	}
+	
+	string out = "//Generated by objlua_embed, do not edit.\n"
+		"#include <objlua/embedded.h>\n\n";
+	string table;
+	
+	lua_State * L = luaL_newstate();
+	for (int i = 3; i < argc; i++) {
+		string name = relative(argv[i], argv[2]);
+		string source;
+		if (!read(argv[i], source)) {
+			fprintf(stderr, "objlua_embed: unable to read %s\n", argv[i]);
+			return 1;
+		}
+		
+		//Skip a leading # line like luaL_loadfile does.
+		size_t offset = 0;
+		if (!source.empty() && source[0] == '#') {
+			offset = source.find('\n');
+			if (offset == string::npos)
+				offset = source.size();
+		}
+		string chunkname = "@" + name;
+		if (luaL_loadbuffer(L, source.data() + offset, source.size() - offset, chunkname.c_str())) {
+			fprintf(stderr, "objlua_embed: %s\n", lua_tostring(L, -1));
+			return 1;
+		}
+		string code;
+		lua_dump(L, writer, &code);
+		lua_pop(L, 1);
+		
+		char line[64];
+		snprintf(line, sizeof(line), "static const unsigned char script%d[] = {", i - 3);
+		out += line;
+		for (size_t j = 0; j < code.size(); j++) {
+			snprintf(line, sizeof(line), "%s%d,", (j % 24 == 0 ? "\n\t" : ""), (unsigned char)code[j]);
+			out += line;
+		}
+		out += "\n};\n";
+		
+		snprintf(line, sizeof(line), ", script%d, sizeof(script%d)},\n", i - 3, i - 3);
+		table += "\t{\"" + name + "\"" + line;
+	}
+	lua_close(L);
+	
+	if (!table.empty())
+		out += "\nstatic const LuaEmbeddedScript scripts[] = {\n" + table + "};\n"
+			"static LuaEmbedded::Registrar registrar(scripts, sizeof(scripts) / sizeof(scripts[0]));\n";
+	
+	FILE * f = fopen(argv[1], "wb");
+	if (!f || fwrite(out.data(), 1, out.size(), f) != out.size() || fclose(f) != 0) {
+		fprintf(stderr, "objlua_embed: unable to write %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
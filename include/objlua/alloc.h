@@ -0,0 +1,209 @@
+#pragma once
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "lua.h"
+
+
+/** Base class of the allocators a LuaState may be created with. Keeps track of
+ the memory used by the state and enforces an optional limit. Subclasses only
+ need to implement the actual allocation.
+ 
+ An allocator is used by a single Lua state and is not thread-safe. */
+class LuaAllocator {
+public:
+	/** Memory statistics of the state using the allocator. */
+	struct Stats {
+		/** Bytes currently allocated. */
+		size_t live;
+		/** Highest number of bytes allocated at once. */
+		size_t peak;
+		/** Number of blocks allocated, including those moved by a reallocation. */
+		size_t allocations;
+		/** Total number of bytes allocated, counting the growth of reallocated
+		 blocks. */
+		size_t allocated;
+		/** Number of blocks freed. */
+		size_t frees;
+		/** Number of allocations refused because of the limit. */
+		size_t refused;
+	};
+	
+	LuaAllocator() : limit(0) { memset(&statistics, 0, sizeof(statistics)); }
+	virtual ~LuaAllocator() {}
+	
+	/** Allocation function to be passed to lua_newstate, with the allocator as
+	 user data. */
+	static void * alloc(void * ud, void * ptr, size_t osize, size_t nsize)
+	{
+		LuaAllocator * a = (LuaAllocator *)ud;
+		Stats & s = a->statistics;
+		
+		//Free blocks.
+		if (nsize == 0) {
+			if (ptr) {
+				a->deallocate(ptr, osize);
+				s.live -= osize;
+				s.frees++;
+			}
+			return NULL;
+		}
+		
+		//Refuse to grow beyond the limit. Lua expects shrinking to succeed.
+		if (a->limit && nsize > osize && s.live + (nsize - osize) > a->limit) {
+			s.refused++;
+			return NULL;
+		}
+		
+		void * result = (ptr ? a->reallocate(ptr, osize, nsize) : a->allocate(nsize));
+		if (!result)
+			return NULL;
+		if (result != ptr) {
+			s.allocations++;
+			if (ptr)
+				s.frees++;
+		}
+		if (!ptr)
+			s.allocated += nsize;
+		else if (nsize > osize)
+			s.allocated += nsize - osize;
+		s.live += nsize;
+		s.live -= (ptr ? osize : 0);
+		if (s.live > s.peak)
+			s.peak = s.live;
+		return result;
+	}
+	
+	/** Returns the memory statistics. */
+	const Stats & getStats() const { return statistics; }
+	
+	/** Returns the maximum number of bytes the state may allocate, or 0 if
+	 there is no limit. */
+	size_t getLimit() const { return limit; }
+	
+	/** Limits the number of bytes the state may allocate. Allocations beyond
+	 the limit fail with a memory error in Lua. Pass 0 to remove the limit. */
+	void setLimit(size_t bytes) { limit = bytes; }
+	
+protected:
+	/** Allocates a new block of the given size. */
+	virtual void * allocate(size_t size) = 0;
+	/** Frees the given block of the given size. */
+	virtual void deallocate(void * ptr, size_t size) = 0;
+	/** Resizes the given block. The default implementation moves the block. */
+	virtual void * reallocate(void * ptr, size_t osize, size_t nsize)
+	{
+		void * result = allocate(nsize);
+		if (result) {
+			memcpy(result, ptr, (osize < nsize ? osize : nsize));
+			deallocate(ptr, osize);
+		}
+		return result;
+	}
+	
+private:
+	Stats statistics;
+	size_t limit;
+};
+
+
+/** Allocator using the general-purpose heap, like the default Lua allocator. */
+class LuaHeapAllocator : public LuaAllocator {
+protected:
+	void * allocate(size_t size) { return malloc(size); }
+	void deallocate(void * ptr, size_t size) { free(ptr); }
+	void * reallocate(void * ptr, size_t osize, size_t nsize) { return realloc(ptr, nsize); }
+};
+
+
+/** Allocator which serves the small blocks that make up most of Lua's alloca-
+ tions (strings, tables, closures, userdata) from pools of fixed-size blocks.
+ Blocks are rounded up to multiples of 8 bytes and carved from larger slabs.
+ Freed blocks are kept for reuse, and all slabs are released at once when the
+ allocator is destroyed. Larger blocks go to the heap. */
+class LuaPoolAllocator : public LuaAllocator {
+public:
+	/** Largest block size served from the pools. */
+	static const size_t MAX_POOLED = 256;
+	/** Size of the slabs the blocks are carved from. */
+	static const size_t SLAB_SIZE = 16384;
+	
+	LuaPoolAllocator() : reserved(0) { memset(pools, 0, sizeof(pools)); }
+	
+	~LuaPoolAllocator()
+	{
+		for (size_t i = 0; i < slabs.size(); i++)
+			free(slabs[i]);
+	}
+	
+	/** Returns the number of bytes held in slabs. */
+	size_t getReserved() const { return reserved; }
+	
+protected:
+	void * allocate(size_t size)
+	{
+		if (size > MAX_POOLED)
+			return malloc(size);
+		
+		Block *& pool = pools[poolIndex(size)];
+		if (!pool && !refill(poolIndex(size)))
+			return NULL;
+		Block * block = pool;
+		pool = block->next;
+		return block;
+	}
+	
+	void deallocate(void * ptr, size_t size)
+	{
+		if (size > MAX_POOLED) {
+			free(ptr);
+			return;
+		}
+		Block * block = (Block *)ptr;
+		block->next = pools[poolIndex(size)];
+		pools[poolIndex(size)] = block;
+	}
+	
+	void * reallocate(void * ptr, size_t osize, size_t nsize)
+	{
+		//Blocks stay where they are if they remain in the same pool.
+		if (osize <= MAX_POOLED && nsize <= MAX_POOLED) {
+			if (poolIndex(osize) == poolIndex(nsize))
+				return ptr;
+		} else if (osize > MAX_POOLED && nsize > MAX_POOLED) {
+			return realloc(ptr, nsize);
+		}
+		return LuaAllocator::reallocate(ptr, osize, nsize);
+	}
+	
+private:
+	struct Block { Block * next; };
+	
+	static const size_t GRANULARITY = 8;
+	static const size_t POOLS = MAX_POOLED / GRANULARITY;
+	
+	Block * pools[POOLS];
+	std::vector<void *> slabs;
+	size_t reserved;
+	
+	static size_t poolIndex(size_t size) { return (size - 1) / GRANULARITY; }
+	
+	/** Carves a new slab into blocks for the given pool. */
+	bool refill(size_t index)
+	{
+		size_t size = (index + 1) * GRANULARITY;
+		char * slab = (char *)malloc(SLAB_SIZE);
+		if (!slab)
+			return false;
+		slabs.push_back(slab);
+		reserved += SLAB_SIZE;
+		
+		size_t n = SLAB_SIZE / size;
+		for (size_t i = n; i > 0; i--) {
+			Block * block = (Block *)(slab + (i - 1) * size);
+			block->next = pools[index];
+			pools[index] = block;
+		}
+		return true;
+	}
+};
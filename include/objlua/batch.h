@@ -0,0 +1,228 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "class.h"
+#include "error.h"
+#include "lua.h"
+#include "method.h"
+#include "value.h"
+
+
+/** Calls a method on many exposed objects at once, e.g. a hook that is invoked
+ on every sprite each frame. The error handler and the arguments are pushed
+ once for the whole batch, and the method is resolved once per run of objects
+ of the same class, so each object only costs pushing its function and in-
+ stance and the protected call itself. Every object is called in a protected
+ call of its own, such that an error in one object is reported and recorded
+ without aborting the rest of the batch.
+ 
+ @code
+ std::vector<Sprite *> sprites;
+ LuaBatch::Result r = LuaBatch::call(sprites, "animate", 0.016);
+ @endcode
+ 
+ As with LuaMethod, the method is resolved through the class, so functions
+ stored in individual instances are only seen for objects whose class was not
+ created through LuaClass::make. All objects must live in the same state. */
+class LuaBatch {
+public:
+	/** Outcome of a batch. */
+	struct Result {
+		/** Number of objects the method was called on successfully. */
+		size_t called;
+		/** Number of objects skipped because they have no instance or their
+		 class does not implement the method. */
+		size_t skipped;
+		/** Positions of the objects whose call raised an error. */
+		std::vector<size_t> failed;
+		
+		Result() : called(0), skipped(0) {}
+	};
+	
+	/** Calls the method with the given name on each of the objects, passing the
+	 given arguments. The objects may be any container or array of pointers to
+	 exposed objects. */
+	template <typename Container, typename... Args>
+	static Result call(const Container & objects, const char * fn, Args &&... args)
+	{
+		lua_State * L = stateOf(objects);
+		if (!L)
+			return Result();
+		LuaMethod method(L, fn);
+		return call(objects, method, std::forward<Args>(args)...);
+	}
+	
+	/** Calls the method behind the given handle on each of the objects. */
+	template <typename Container, typename... Args>
+	static Result call(const Container & objects, LuaMethod & method, Args &&... args)
+	{
+		Result result;
+		Frame frame(method, result, std::forward<Args>(args)...);
+		size_t index = 0;
+		for (auto it = std::begin(objects); it != std::end(objects); ++it)
+			frame.invoke(*it, index++);
+		return result;
+	}
+	
+	/** Calls the method with the given name on each of the objects, visiting
+	 them grouped by class such that the method is resolved once per class.
+	 Objects of the same class are called in their original order. */
+	template <typename Container, typename... Args>
+	static Result callGrouped(const Container & objects, const char * fn, Args &&... args)
+	{
+		lua_State * L = stateOf(objects);
+		if (!L)
+			return Result();
+		LuaMethod method(L, fn);
+		return callGrouped(objects, method, std::forward<Args>(args)...);
+	}
+	
+	/** Calls the method behind the given handle on each of the objects, grouped
+	 by class. */
+	template <typename Container, typename... Args>
+	static Result callGrouped(const Container & objects, LuaMethod & method, Args &&... args)
+	{
+		typedef typename std::decay<decltype(*std::begin(objects))>::type Pointer;
+		std::vector<std::pair<Pointer, size_t> > order;
+		size_t index = 0;
+		for (auto it = std::begin(objects); it != std::end(objects); ++it)
+			order.push_back(std::make_pair(*it, index++));
+		std::stable_sort(order.begin(), order.end(), byClass<Pointer>);
+		
+		Result result;
+		Frame frame(method, result, std::forward<Args>(args)...);
+		for (size_t i = 0; i < order.size(); i++)
+			frame.invoke(order[i].first, order[i].second);
+		return result;
+	}
+	
+private:
+	/** Returns the state of the first object, or NULL if there is none. */
+	template <typename Container>
+	static lua_State * stateOf(const Container & objects)
+	{
+		for (auto it = std::begin(objects); it != std::end(objects); ++it)
+			if (*it)
+				return (*it)->getState();
+		return NULL;
+	}
+	
+	template <typename Pointer>
+	static bool byClass(const std::pair<Pointer, size_t> & a, const std::pair<Pointer, size_t> & b)
+	{
+		LuaClassInfo * ca = (a.first ? a.first->getClass() : NULL);
+		LuaClassInfo * cb = (b.first ? b.first->getClass() : NULL);
+		return std::less<LuaClassInfo *>()(ca, cb);
+	}
+	
+	/** Stack layout shared by the calls of a batch. Holds the error handler,
+	 the arguments and the method of the class called last, and restores the
+	 stack when the batch is done. */
+	class Frame {
+	public:
+		template <typename... Args>
+		Frame(LuaMethod & method, Result & result, Args &&... args)
+		: L(method.getState()), method(method), result(result),
+		  argc((int)sizeof...(Args)), cls(NULL), version(0)
+		{
+			base = lua_gettop(L);
+			lua_checkstack(L, argc + 5);
+			
+			//The error handler, the arguments and a slot for the method.
+			method.pushHandler();
+			(LuaValue<typename std::decay<Args>::type>::push(L, args), ...);
+			lua_pushnil(L);
+		}
+		
+		~Frame() { lua_settop(L, base); }
+		
+		/** Calls the method on the given object, which is at the given posi-
+		 tion in the batch. */
+		template <typename T>
+		void invoke(T * object, size_t index)
+		{
+			const int trace = base + 1;
+			const int fn = base + argc + 2;
+			if (!object) {
+				result.skipped++;
+				return;
+			}
+			
+			LuaClassInfo * c = object->getClass();
+			if (c) {
+				//Resolve the method whenever the class changes, or a script
+				//modified the class in the meantime.
+				if (c != cls || c->version != version) {
+					if (!method.push(c))
+						lua_pushnil(L);
+					lua_replace(L, fn);
+					cls = c;
+					version = c->version;
+				}
+				if (lua_isnil(L, fn)) {
+#ifdef OBJLUA_METRICS
+					lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+					LuaMetrics::missing(L, -1, method.getName());
+					lua_pop(L, 1);
+#endif
+					result.skipped++;
+					return;
+				}
+				lua_pushvalue(L, fn);
+				object->loadReference();
+				if (lua_isnil(L, -1)) {
+					lua_pop(L, 2);
+					result.skipped++;
+					return;
+				}
+			} else {
+				//Instances of tables that are no proper classes fall back to a
+				//regular lookup.
+				object->loadReference();
+				if (!lua_istable(L, -1) && !lua_isuserdata(L, -1)) {
+					lua_pop(L, 1);
+					result.skipped++;
+					return;
+				}
+				lua_getfield(L, -1, method.getName());
+				if (!lua_isfunction(L, -1)) {
+#ifdef OBJLUA_METRICS
+					LuaMetrics::missing(L, -2, method.getName());
+#endif
+					lua_pop(L, 2);
+					result.skipped++;
+					return;
+				}
+				lua_insert(L, -2);
+			}
+			
+			//Push the arguments and call the method.
+			for (int i = 0; i < argc; i++)
+				lua_pushvalue(L, trace + 1 + i);
+			if (Lua::pcall(L, method.getName(), argc, 0, trace) != 0) {
+				LuaError::report(L);
+				result.failed.push_back(index);
+			} else {
+				result.called++;
+			}
+		}
+	
+	private:
+		Frame(const Frame &);
+		Frame & operator=(const Frame &);
+		
+		lua_State * L;
+		LuaMethod & method;
+		Result & result;
+		int argc;
+		/** Stack top before the batch. */
+		int base;
+		/** Class and version the method in the method slot was resolved for. */
+		LuaClassInfo * cls;
+		unsigned version;
+	};
+};
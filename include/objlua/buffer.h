@@ -0,0 +1,453 @@
+#pragma once
+#include <cstdint>
+#include <iostream>
+#include <type_traits>
+#include <vector>
+#include "lua.h"
+#include "object.h"
+
+
+/** Exposes a contiguous array of numbers owned by C++ to Lua without copying
+ it. The view is a userdata pointing into the array, which scripts index like
+ a table, starting at 1. Elements may be floats, doubles or 32 bit integers,
+ and may be strided, e.g. to view the x coordinates of an array of positions.
+ Views of const arrays are read-only. Indices are checked against the bounds.
+ 
+ @code
+ std::vector<float> samples(4096);
+ LuaBuffer::push(L, sprite, samples);
+ lua_setglobal(L, "samples");
+ LuaBuffer::push(L, sprite, &positions[0].x, positions.size(), 3);
+ @endcode
+ 
+ Besides indexing and #, views have bulk methods which run as plain loops in
+ C++, which the compiler vectorizes for unstrided views:
+ 
+ @code
+ samples:fill(0)
+ samples:copy(other)              -- another view or a table of equal length
+ samples:map(function(x, i) return x * 0.5 end)
+ print(samples:sum(), samples:min(), samples:max())
+ @endcode
+ 
+ A view is tied to the exposed object owning the array. Once the object has
+ been deleted, accessing the view raises an error rather than touching freed
+ memory. The owner must keep the array in place for as long as views of it
+ exist, i.e. not resize a vector that is being viewed. */
+class LuaBuffer {
+public:
+	/** Type of the elements of a view. */
+	enum Type { FLOAT, DOUBLE, INT32 };
+	
+	/** Pushes a view of the given number of elements, each stride elements
+	 apart, which belong to the given exposed object. Pushes nil if the object
+	 has no instance. */
+	template <typename Owner, typename T>
+	static void push(lua_State * L, Owner * owner, T * elements, size_t size, size_t stride = 1)
+	{
+		typedef typename std::remove_const<T>::type Element;
+		static_assert(std::is_same<Element, float>::value || std::is_same<Element, double>::value ||
+					  std::is_same<Element, int32_t>::value,
+					  "Buffers hold floats, doubles or 32 bit integers");
+		Type type = (std::is_same<Element, float>::value ? FLOAT :
+					 std::is_same<Element, double>::value ? DOUBLE : INT32);
+		owner->loadReference();
+		create(L, type, (void *)elements, size, (stride ? stride : 1), std::is_const<T>::value);
+	}
+	
+	/** Pushes a view of all elements of the given vector. */
+	template <typename Owner, typename T>
+	static void push(lua_State * L, Owner * owner, std::vector<T> & elements)
+	{
+		push(L, owner, elements.data(), elements.size());
+	}
+	
+	/** Pushes a read-only view of all elements of the given vector. */
+	template <typename Owner, typename T>
+	static void push(lua_State * L, Owner * owner, const std::vector<T> & elements)
+	{
+		push(L, owner, elements.data(), elements.size());
+	}
+	
+	/** Returns whether the value at the given index is a view. */
+	static bool isBuffer(lua_State * L, int index)
+	{
+		if (lua_type(L, index) != LUA_TUSERDATA || !lua_getmetatable(L, index))
+			return false;
+		pushMetatable(L);
+		bool result = lua_rawequal(L, -1, -2);
+		lua_pop(L, 2);
+		return result;
+	}
+	
+private:
+	/** Memory block of a view. */
+	struct View {
+		void * elements;
+		size_t size;
+		size_t stride;
+		Type type;
+		bool readOnly;
+		/** Data of the owner's instance, whose object is NULL once the owner
+		 has been deleted. The view's environment keeps it alive. */
+		LuaObject::Data * owner;
+	};
+	
+	/** Creates a view of the given elements, replacing the owner's instance
+	 on top of the stack. */
+	static void create(lua_State * L, Type type, void * elements, size_t size, size_t stride,
+					   bool readOnly)
+	{
+		//Find the data of the owner, which userdata instances carry them-
+		//selves and table instances keep in their __this field.
+		LuaObject::Data * owner = LuaObject::toData(L, -1);
+		if (owner) {
+			lua_pushvalue(L, -1);
+		} else if (lua_istable(L, -1)) {
+			lua_pushliteral(L, "__this");
+			lua_rawget(L, -2);
+			owner = LuaObject::toData(L, -1);
+		} else {
+			lua_pushnil(L);
+		}
+		if (!owner) {
+			lua_pop(L, 2);
+			std::cerr << "objlua: *** Unable to create buffer. Owner has no instance.\n";
+			lua_pushnil(L);
+			return;
+		}
+		
+		View * view = (View *)lua_newuserdata(L, sizeof(View));
+		view->elements = elements;
+		view->size = size;
+		view->stride = stride;
+		view->type = type;
+		view->readOnly = readOnly;
+		view->owner = owner;
+		pushMetatable(L);
+		lua_setmetatable(L, -2);
+		lua_createtable(L, 1, 0);
+		lua_pushvalue(L, -3);
+		lua_rawseti(L, -2, 1);
+		lua_setfenv(L, -2);
+		lua_replace(L, -3);
+		lua_pop(L, 1);
+	}
+	
+	/** Pushes the metatable shared by all views, creating it if required. */
+	static void pushMetatable(lua_State * L)
+	{
+		lua_pushlightuserdata(L, (void *)&pushMetatable);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		if (!lua_isnil(L, -1))
+			return;
+		lua_pop(L, 1);
+		
+		static const luaL_Reg methods[] = {
+			{"fill", lua_fill},
+			{"copy", lua_copyFrom},
+			{"map", lua_map},
+			{"sum", lua_sum},
+			{"min", lua_min},
+			{"max", lua_max},
+			{NULL, NULL}
+		};
+		lua_newtable(L);
+		lua_newtable(L);
+		luaL_register(L, NULL, methods);
+		lua_pushcclosure(L, lua_index, 1);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lua_newindex);
+		lua_setfield(L, -2, "__newindex");
+		lua_pushcfunction(L, lua_length);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, lua_toString);
+		lua_setfield(L, -2, "__tostring");
+		lua_pushliteral(L, "buffer");
+		lua_setfield(L, -2, "__metatable");
+		lua_pushlightuserdata(L, (void *)&pushMetatable);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+	
+	/** Returns the view at the given index, raising an error if the value is
+	 no view or its owner has been deleted. */
+	static View * check(lua_State * L, int index)
+	{
+		if (!isBuffer(L, index))
+			luaL_typerror(L, index, "buffer");
+		View * view = (View *)lua_touserdata(L, index);
+		if (!view->owner->object)
+			luaL_error(L, "Buffer of a deleted object accessed.");
+		return view;
+	}
+	
+	/** Returns the zero-based position of the element whose one-based index
+	 is at the given stack index, raising an error if it is out of bounds. */
+	static size_t checkIndex(lua_State * L, const View * view, int index)
+	{
+		lua_Number n = luaL_checknumber(L, index);
+		lua_Integer i = lua_tointeger(L, index);
+		if ((lua_Number)i != n || i < 1 || (size_t)i > view->size)
+			luaL_error(L, "Buffer index %f out of range 1..%d.", n, (int)view->size);
+		return (size_t)(i - 1);
+	}
+	
+	static lua_Number get(const View * view, size_t i)
+	{
+		switch (view->type) {
+			case FLOAT: return ((const float *)view->elements)[i * view->stride];
+			case DOUBLE: return ((const double *)view->elements)[i * view->stride];
+			default: return ((const int32_t *)view->elements)[i * view->stride];
+		}
+	}
+	
+	/** Assigns the number at the given stack index to the element at the
+	 given position. */
+	static void set(lua_State * L, View * view, size_t i, int index)
+	{
+		switch (view->type) {
+			case FLOAT:
+				((float *)view->elements)[i * view->stride] = (float)luaL_checknumber(L, index);
+				break;
+			case DOUBLE:
+				((double *)view->elements)[i * view->stride] = luaL_checknumber(L, index);
+				break;
+			default:
+				((int32_t *)view->elements)[i * view->stride] = (int32_t)luaL_checkinteger(L, index);
+				break;
+		}
+	}
+	
+	/** Kernels of the bulk methods. The unstrided loops are kept free of
+	 calls and early exits, so the compiler vectorizes them. */
+	template <typename T>
+	static void fill(T * p, size_t n, size_t stride, T value)
+	{
+		if (stride == 1) {
+			for (size_t i = 0; i < n; i++)
+				p[i] = value;
+		} else {
+			for (size_t i = 0; i < n; i++)
+				p[i * stride] = value;
+		}
+	}
+	
+	template <typename T>
+	static lua_Number sum(const T * p, size_t n, size_t stride)
+	{
+		//Four independent sums, since the compiler may not reorder a single
+		//floating point sum.
+		double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+		size_t i = 0;
+		if (stride == 1) {
+			for (; i + 4 <= n; i += 4) {
+				s0 += p[i];
+				s1 += p[i + 1];
+				s2 += p[i + 2];
+				s3 += p[i + 3];
+			}
+		}
+		for (; i < n; i++)
+			s0 += p[i * stride];
+		return (lua_Number)((s0 + s1) + (s2 + s3));
+	}
+	
+	template <typename T>
+	static lua_Number min(const T * p, size_t n, size_t stride)
+	{
+		T m = p[0];
+		if (stride == 1) {
+			for (size_t i = 1; i < n; i++)
+				m = (p[i] < m ? p[i] : m);
+		} else {
+			for (size_t i = 1; i < n; i++)
+				m = (p[i * stride] < m ? p[i * stride] : m);
+		}
+		return (lua_Number)m;
+	}
+	
+	template <typename T>
+	static lua_Number max(const T * p, size_t n, size_t stride)
+	{
+		T m = p[0];
+		if (stride == 1) {
+			for (size_t i = 1; i < n; i++)
+				m = (p[i] > m ? p[i] : m);
+		} else {
+			for (size_t i = 1; i < n; i++)
+				m = (p[i * stride] > m ? p[i * stride] : m);
+		}
+		return (lua_Number)m;
+	}
+	
+	/** Copies between two views of the same type, or converts element by
+	 element otherwise. */
+	template <typename T, typename S>
+	static void copy(T * to, size_t toStride, const S * from, size_t fromStride, size_t n)
+	{
+		if (toStride == 1 && fromStride == 1) {
+			for (size_t i = 0; i < n; i++)
+				to[i] = (T)from[i];
+		} else {
+			for (size_t i = 0; i < n; i++)
+				to[i * toStride] = (T)from[i * fromStride];
+		}
+	}
+	
+	template <typename T>
+	static void convert(View * to, const View * from)
+	{
+		T * p = (T *)to->elements;
+		switch (from->type) {
+			case FLOAT: copy(p, to->stride, (const float *)from->elements, from->stride, to->size); break;
+			case DOUBLE: copy(p, to->stride, (const double *)from->elements, from->stride, to->size); break;
+			default: copy(p, to->stride, (const int32_t *)from->elements, from->stride, to->size); break;
+		}
+	}
+	
+	static void checkWritable(lua_State * L, const View * view)
+	{
+		if (view->readOnly)
+			luaL_error(L, "Buffer is read-only.");
+	}
+	
+	/** __index metamethod. Numbers index the elements, anything else the
+	 methods, which are the upvalue. */
+	static int lua_index(lua_State * L)
+	{
+		View * view = check(L, 1);
+		if (lua_type(L, 2) != LUA_TNUMBER) {
+			lua_gettable(L, lua_upvalueindex(1));
+			return 1;
+		}
+		lua_pushnumber(L, get(view, checkIndex(L, view, 2)));
+		return 1;
+	}
+	
+	static int lua_newindex(lua_State * L)
+	{
+		View * view = check(L, 1);
+		checkWritable(L, view);
+		set(L, view, checkIndex(L, view, 2), 3);
+		return 0;
+	}
+	
+	static int lua_length(lua_State * L)
+	{
+		lua_pushinteger(L, (lua_Integer)check(L, 1)->size);
+		return 1;
+	}
+	
+	static int lua_toString(lua_State * L)
+	{
+		View * view = (View *)lua_touserdata(L, 1);
+		static const char * types[] = {"float", "double", "int32"};
+		lua_pushfstring(L, "buffer<%s>[%d]: %p", types[view->type], (int)view->size, view->elements);
+		return 1;
+	}
+	
+	/** buffer:fill(value) assigns the value to all elements. */
+	static int lua_fill(lua_State * L)
+	{
+		View * view = check(L, 1);
+		checkWritable(L, view);
+		switch (view->type) {
+			case FLOAT: fill((float *)view->elements, view->size, view->stride, (float)luaL_checknumber(L, 2)); break;
+			case DOUBLE: fill((double *)view->elements, view->size, view->stride, (double)luaL_checknumber(L, 2)); break;
+			default: fill((int32_t *)view->elements, view->size, view->stride, (int32_t)luaL_checkinteger(L, 2)); break;
+		}
+		return 0;
+	}
+	
+	/** buffer:copy(source) assigns the elements of another view or of a table
+	 of the same length. */
+	static int lua_copyFrom(lua_State * L)
+	{
+		View * view = check(L, 1);
+		checkWritable(L, view);
+		if (lua_istable(L, 2)) {
+			if (lua_objlen(L, 2) != view->size)
+				return luaL_error(L, "Unable to copy %d elements into a buffer of %d.",
+								  (int)lua_objlen(L, 2), (int)view->size);
+			for (size_t i = 0; i < view->size; i++) {
+				lua_rawgeti(L, 2, (int)i + 1);
+				set(L, view, i, -1);
+				lua_pop(L, 1);
+			}
+			return 0;
+		}
+		
+		View * from = check(L, 2);
+		if (from->size != view->size)
+			return luaL_error(L, "Unable to copy %d elements into a buffer of %d.",
+							  (int)from->size, (int)view->size);
+		switch (view->type) {
+			case FLOAT: convert<float>(view, from); break;
+			case DOUBLE: convert<double>(view, from); break;
+			default: convert<int32_t>(view, from); break;
+		}
+		return 0;
+	}
+	
+	/** buffer:map(fn) replaces every element by fn(element, index). */
+	static int lua_map(lua_State * L)
+	{
+		View * view = check(L, 1);
+		checkWritable(L, view);
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+		for (size_t i = 0; i < view->size; i++) {
+			lua_pushvalue(L, 2);
+			lua_pushnumber(L, get(view, i));
+			lua_pushinteger(L, (lua_Integer)i + 1);
+			lua_call(L, 2, 1);
+			
+			//The function may have deleted the owner.
+			if (!view->owner->object)
+				return luaL_error(L, "Buffer of a deleted object accessed.");
+			set(L, view, i, -1);
+			lua_pop(L, 1);
+		}
+		return 0;
+	}
+	
+	/** buffer:sum() returns the sum of the elements. */
+	static int lua_sum(lua_State * L)
+	{
+		View * view = check(L, 1);
+		switch (view->type) {
+			case FLOAT: lua_pushnumber(L, sum((const float *)view->elements, view->size, view->stride)); break;
+			case DOUBLE: lua_pushnumber(L, sum((const double *)view->elements, view->size, view->stride)); break;
+			default: lua_pushnumber(L, sum((const int32_t *)view->elements, view->size, view->stride)); break;
+		}
+		return 1;
+	}
+	
+	/** buffer:min() returns the smallest element, or nil if there is none. */
+	static int lua_min(lua_State * L)
+	{
+		View * view = check(L, 1);
+		if (!view->size)
+			return 0;
+		switch (view->type) {
+			case FLOAT: lua_pushnumber(L, min((const float *)view->elements, view->size, view->stride)); break;
+			case DOUBLE: lua_pushnumber(L, min((const double *)view->elements, view->size, view->stride)); break;
+			default: lua_pushnumber(L, min((const int32_t *)view->elements, view->size, view->stride)); break;
+		}
+		return 1;
+	}
+	
+	/** buffer:max() returns the largest element, or nil if there is none. */
+	static int lua_max(lua_State * L)
+	{
+		View * view = check(L, 1);
+		if (!view->size)
+			return 0;
+		switch (view->type) {
+			case FLOAT: lua_pushnumber(L, max((const float *)view->elements, view->size, view->stride)); break;
+			case DOUBLE: lua_pushnumber(L, max((const double *)view->elements, view->size, view->stride)); break;
+			default: lua_pushnumber(L, max((const int32_t *)view->elements, view->size, view->stride)); break;
+		}
+		return 1;
+	}
+};
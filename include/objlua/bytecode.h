@@ -0,0 +1,309 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lua.h"
+
+
+/** Cache of precompiled Lua chunks on disk. The first time a script is loaded
+ through the cache, the compiled chunk is dumped into the cache directory.
+ Later loads map the cached chunk into memory and hand it to Lua directly,
+ skipping the parser.
+ 
+ Cached chunks are named after a hash of the script's path and record the
+ path, modification time, size and a content hash of the script. A cached
+ chunk is used as is while modification time and size match. If they differ,
+ the script is hashed, and the chunk is only recompiled if the content has
+ changed. Chunks are written to a temporary file and renamed into place, so
+ several states or processes may share a cache directory.
+ 
+ @code
+ LuaBytecodeCache cache(".luacache");
+ cache.prewarm("scripts/sprite.lua");
+ lua.setBytecodeCache(&cache);
+ lua.dofile("scripts/sprite.lua");
+ @endcode */
+class LuaBytecodeCache {
+public:
+	/** Counters of how loads were served. */
+	struct Stats {
+		/** Loads served from the cache. */
+		size_t hits;
+		/** Loads of scripts that were not cached yet. */
+		size_t misses;
+		/** Loads of scripts whose cached chunk was outdated. */
+		size_t stale;
+	};
+	
+	/** Creates a cache keeping its chunks in the given directory, which is
+	 created if it does not exist yet. */
+	LuaBytecodeCache(const std::string & directory) : directory(directory), hits(0), misses(0), stale(0)
+	{
+		mkdir(directory.c_str(), 0755);
+	}
+	
+	/** Returns the directory the chunks are kept in. */
+	const std::string & getDirectory() const { return directory; }
+	
+	/** Returns the counters of how loads were served. */
+	Stats getStats() const
+	{
+		Stats s;
+		s.hits = hits;
+		s.misses = misses;
+		s.stale = stale;
+		return s;
+	}
+	
+	/** Loads the given script as a function onto the stack, taking it from the
+	 cache if possible. Behaves like luaL_loadfile, i.e. returns 0 on success
+	 and pushes an error message otherwise. */
+	int load(lua_State * L, const char * path)
+	{
+		struct stat info;
+		if (stat(path, &info) != 0)
+			return luaL_loadfile(L, path);
+		std::string chunkname = std::string("@") + path;
+		std::string file = cachePath(path);
+		
+		//Try the cached chunk.
+		std::string source;
+		bool outdated = false;
+		Mapping mapping;
+		if (mapping.open(file)) {
+			const Header * header = mapping.header(path);
+			if (header) {
+				bool fresh = (header->mtime == (int64_t)info.st_mtime &&
+							  header->size == (int64_t)info.st_size);
+				if (!fresh && read(path, source) && hash(source) == header->hash) {
+					//The script was touched without changing, so record its new
+					//modification time.
+					store(file, path, info, header->hash, mapping.code(), mapping.codeSize());
+					fresh = true;
+				}
+				if (fresh) {
+					hits++;
+					return luaL_loadbuffer(L, mapping.code(), mapping.codeSize(), chunkname.c_str());
+				}
+				outdated = true;
+			}
+		}
+		mapping.close();
+		
+		//Compile the script and dump the chunk.
+		if (source.empty() && !read(path, source))
+			return luaL_loadfile(L, path);
+		if (!source.empty() && source[0] == LUA_SIGNATURE[0])
+			return luaL_loadfile(L, path);
+		if (outdated)
+			stale++;
+		else
+			misses++;
+		
+		//Skip a leading # line like luaL_loadfile does, keeping the newline so
+		//line numbers remain the same.
+		size_t offset = 0;
+		if (!source.empty() && source[0] == '#') {
+			offset = source.find('\n');
+			if (offset == std::string::npos)
+				offset = source.size();
+		}
+		int error = luaL_loadbuffer(L, source.data() + offset, source.size() - offset, chunkname.c_str());
+		if (error)
+			return error;
+		
+		std::string code;
+		lua_dump(L, writer, &code);
+		store(file, path, info, hash(source), code.data(), code.size());
+		return 0;
+	}
+	
+	/** Compiles the given script into the cache unless it is cached already.
+	 Returns false if the script could not be compiled. */
+	bool prewarm(const char * path)
+	{
+		lua_State * L = luaL_newstate();
+		if (!L)
+			return false;
+		bool result = (load(L, path) == 0);
+		lua_close(L);
+		return result;
+	}
+	
+	/** Compiles the given scripts into the cache. Returns the number of scripts
+	 that could be compiled. */
+	size_t prewarm(const std::vector<std::string> & paths)
+	{
+		size_t compiled = 0;
+		for (size_t i = 0; i < paths.size(); i++)
+			if (prewarm(paths[i].c_str()))
+				compiled++;
+		return compiled;
+	}
+	
+	/** Removes the cached chunk of the given script. */
+	void invalidate(const char * path) { unlink(cachePath(path).c_str()); }
+	
+	/** Removes all cached chunks. */
+	void clear()
+	{
+		DIR * dir = opendir(directory.c_str());
+		if (!dir)
+			return;
+		while (struct dirent * entry = readdir(dir)) {
+			std::string name = entry->d_name;
+			if (name.size() > 5 && name.compare(name.size() - 5, 5, ".luac") == 0)
+				unlink((directory + "/" + name).c_str());
+		}
+		closedir(dir);
+	}
+	
+private:
+	/** Layout of a cache file. The header is followed by the script's path and
+	 the chunk. */
+	struct Header {
+		char magic[4];
+		uint32_t pathLength;
+		int64_t mtime;
+		int64_t size;
+		uint64_t hash;
+	};
+	
+	/** A cache file mapped into memory. */
+	class Mapping {
+	public:
+		Mapping() : data(NULL), length(0), pathLength(0) {}
+		~Mapping() { close(); }
+		
+		bool open(const std::string & file)
+		{
+			int fd = ::open(file.c_str(), O_RDONLY);
+			if (fd < 0)
+				return false;
+			struct stat info;
+			if (fstat(fd, &info) == 0 && (size_t)info.st_size > sizeof(Header)) {
+				length = (size_t)info.st_size;
+				data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (data == MAP_FAILED)
+					data = NULL;
+			}
+			::close(fd);
+			return (data != NULL);
+		}
+		
+		void close()
+		{
+			if (data)
+				munmap(data, length);
+			data = NULL;
+		}
+		
+		/** Returns the header if the file is a valid cache file for the given
+		 path, or NULL otherwise. */
+		const Header * header(const char * path)
+		{
+			const Header * h = (const Header *)data;
+			size_t n = strlen(path);
+			if (memcmp(h->magic, MAGIC, 4) != 0 || h->pathLength != n ||
+				sizeof(Header) + n >= length ||
+				memcmp((const char *)data + sizeof(Header), path, n) != 0)
+				return NULL;
+			pathLength = n;
+			return h;
+		}
+		
+		const char * code() const { return (const char *)data + sizeof(Header) + pathLength; }
+		size_t codeSize() const { return length - sizeof(Header) - pathLength; }
+	
+	private:
+		void * data;
+		size_t length;
+		size_t pathLength;
+	};
+	
+	static constexpr const char * MAGIC = "OLBC";
+	
+	std::string directory;
+	std::atomic<size_t> hits;
+	std::atomic<size_t> misses;
+	std::atomic<size_t> stale;
+	
+	/** 64 bit FNV-1a hash. */
+	static uint64_t hash(const char * data, size_t length)
+	{
+		uint64_t h = 14695981039346656037ull;
+		for (size_t i = 0; i < length; i++) {
+			h ^= (unsigned char)data[i];
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+	static uint64_t hash(const std::string & s) { return hash(s.data(), s.size()); }
+	
+	/** Returns the name of the cache file of the given script. */
+	std::string cachePath(const char * path) const
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.luac", (unsigned long long)hash(path, strlen(path)));
+		return directory + name;
+	}
+	
+	/** Reads the given file into a string. */
+	static bool read(const char * path, std::string & content)
+	{
+		FILE * f = fopen(path, "rb");
+		if (!f)
+			return false;
+		content.clear();
+		char buffer[4096];
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+			content.append(buffer, n);
+		bool ok = !ferror(f);
+		fclose(f);
+		return ok;
+	}
+	
+	/** Writes a cache file, replacing the previous one atomically. */
+	static void store(const std::string & file, const char * path, const struct stat & info,
+					  uint64_t contentHash, const char * code, size_t size)
+	{
+		Header header;
+		memcpy(header.magic, MAGIC, 4);
+		header.pathLength = (uint32_t)strlen(path);
+		header.mtime = (int64_t)info.st_mtime;
+		header.size = (int64_t)info.st_size;
+		header.hash = contentHash;
+		
+		char suffix[64];
+		snprintf(suffix, sizeof(suffix), ".%d.%zu.tmp", (int)getpid(),
+				 std::hash<std::thread::id>()(std::this_thread::get_id()));
+		std::string temp = file + suffix;
+		FILE * f = fopen(temp.c_str(), "wb");
+		if (!f)
+			return;
+		bool ok = (fwrite(&header, sizeof(header), 1, f) == 1 &&
+				   fwrite(path, 1, header.pathLength, f) == header.pathLength &&
+				   fwrite(code, 1, size, f) == size);
+		ok = (fclose(f) == 0 && ok);
+		if (!ok || rename(temp.c_str(), file.c_str()) != 0)
+			unlink(temp.c_str());
+	}
+	
+	/** Writer passed to lua_dump which appends to a string. */
+	static int writer(lua_State * L, const void * p, size_t size, void * ud)
+	{
+		((std::string *)ud)->append((const char *)p, size);
+		return 0;
+	}
+};
@@ -1,11 +1,69 @@
 #pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <sys/stat.h>
 #include "error.h"
 #include "lua.h"
+#include "object.h"
 #include "stack.h"
 #include "state.h"
 
 
+/** Bookkeeping for a class created through LuaClass::make. An instance of this
+ structure lives as userdata in the __info field of every class table. */
+struct LuaClassInfo {
+	/** Incremented whenever a field of the class or one of its superclasses is
+	 assigned. Anything cached about the class is valid as long as the version
+	 it was computed for is current. */
+	unsigned version;
+	/** Registry reference to the class table. */
+	int ref;
+	/** Whether inherited methods are copied into the class's method table,
+	 see LuaClass::flatten. */
+	enum Flattening { NOT_FLATTENED, FLATTENED, FLATTENED_LAZILY } flattening;
+	/** Number of exposed objects whose live instance was created as this
+	 class, not counting subclasses. */
+	size_t instances;
+	/** Presence cache of the hooks, see LuaClass::implements. For each hook
+	 whose bit is set in hooksKnown, hooksPresent tells whether the class im-
+	 plements it. Only valid while version equals hooksVersion. */
+	unsigned hooksVersion;
+	uint64_t hooksKnown;
+	uint64_t hooksPresent;
+};
+
+
+/** Name of a method which C++ code calls on many objects although only some
+ of their classes implement it, such as an optional per-frame hook. Every hook
+ gets a bit in the presence cache of the classes, so asking whether a class
+ implements it takes no string lookup once the answer is known. Hooks are
+ meant to be declared once, as static objects. Only the first 64 hooks get a
+ bit, later ones are looked up every time.
+ 
+ @code
+ static const LuaHook onFrame("onFrame");
+ sprite->call(onFrame, dt);
+ @endcode */
+struct LuaHook {
+	/** Name of the method. */
+	const char * name;
+	/** Bit of the hook in the presence cache, or -1 if it has none. */
+	int bit;
+	
+	explicit LuaHook(const char * name) : name(name), bit(allocate()) {}
+	
+private:
+	static int allocate()
+	{
+		static std::atomic<int> count(0);
+		int bit = count++;
+		return (bit < 64 ? bit : -1);
+	}
+};
+
+
 class LuaClass {
 public:
 	/** Installs the class extensions in the given Lua state. **/
@@ -29,39 +87,330 @@ public:
 		lua_pop(L, 1);
 	}
 	
+	/** Function exposing a C++ class to Lua, such as Sprite::expose. */
+	typedef void (*Exposer)(lua_State * L);
+	
+	/** Counters of the classes registered for autoloading in a state. */
+	struct AutoloadStats {
+		/** Number of classes registered. */
+		size_t registered;
+		/** Number of registered classes that have been loaded. */
+		size_t materialized;
+	};
+	
+	/** Registers a class to be loaded the first time a script reads the global
+	 of its name, rather than up front. Loading the class calls expose, if
+	 given, and runs the script, if given, through LuaState::dofile. A script
+	 is run at most once by the autoloader, so a class and the subclasses it
+	 defines may be registered with the same script.
+	 
+	 @code
+	 LuaClass::autoload(lua, "Sprite", Sprite::expose, "scripts/sprite.lua");
+	 LuaClass::autoload(lua, "SpecialSprite", NULL, "scripts/sprite.lua");
+	 @endcode */
+	static void autoload(lua_State * L, const char * className, Exposer expose,
+						 const char * script = NULL)
+	{
+		pushAutoload(L, true);
+		lua_getfield(L, -1, "classes");
+		lua_newtable(L);
+		if (expose) {
+			lua_pushlightuserdata(L, (void *)expose);
+			lua_setfield(L, -2, "expose");
+		}
+		if (script) {
+			lua_pushstring(L, script);
+			lua_setfield(L, -2, "script");
+		}
+		lua_setfield(L, -2, className);
+		lua_getfield(L, -2, "stats");
+		((AutoloadStats *)lua_touserdata(L, -1))->registered++;
+		lua_pop(L, 3);
+	}
+	
+	/** Returns how many classes have been registered for autoloading in the
+	 given state, and how many of them have actually been loaded. */
+	static AutoloadStats getAutoloadStats(lua_State * L)
+	{
+		AutoloadStats stats = {0, 0};
+		pushAutoload(L, false);
+		if (lua_istable(L, -1)) {
+			lua_getfield(L, -1, "stats");
+			stats = *(AutoloadStats *)lua_touserdata(L, -1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		return stats;
+	}
+	
 	/** Creates a new bare class with the given name on the stack. If a super-
-	 class index is provided, the new class will extend the given class. */
+	 class index is provided, the new class will extend the given class.
+	 
+	 The class table itself only holds the fields starting with two under-
+	 scores, i.e. the metamethods of its instances. All other fields are stored
+	 in a separate method table, __methods, which the class table also uses as
+	 __index unless its instances are userdata (see LuaObject). Assign-
+	 ments to the class table are routed through its metatable, which allows
+	 the class to notice any change to its methods and bump its version. */
 	static void make(lua_State * L, const char * className, int superclass = 0)
 	{
 		if (superclass < 0)
-			superclass += lua_gettop(L);
+			superclass += lua_gettop(L) + 1;
 		
 		//Create the new class table.
 		lua_newtable(L);
+		int cls = lua_gettop(L);
 		
-		//Since this table is going to be used as a metatable, make function
-		//lookups occur in the metatable itself.
+		//Create the method table. Instances look up their functions there.
+		lua_newtable(L);
 		lua_pushvalue(L, -1);
-		lua_setfield(L, -2, "__index");
+		lua_setfield(L, cls, "__index");
+		lua_pushvalue(L, -1);
+		lua_setfield(L, cls, "__methods");
 		
-		//Store the class name.
+		//Store the class name, also in the method table so instances can
+		//access it.
+		lua_pushstring(L, className);
+		lua_setfield(L, cls, "__class");
 		lua_pushstring(L, className);
 		lua_setfield(L, -2, "__class");
 		
-		//Set the superclass as the __index element. This will redirect un-
-		//known function calls to the superclass.
+		//Set the superclass's methods as the __index element of the method
+		//table. This will redirect unknown function calls to the superclass.
 		if (superclass) {
 			lua_newtable(L);
-			lua_pushvalue(L, superclass);
+			lua_getfield(L, superclass, "__methods");
+			if (!lua_istable(L, -1)) {
+				lua_pop(L, 1);
+				lua_pushvalue(L, superclass);
+			}
 			lua_setfield(L, -2, "__index");
 			lua_setmetatable(L, -2);
+			
+			//Register the new class with its superclass so changes to the
+			//superclass invalidate the new class as well.
+			lua_getfield(L, superclass, "__subclasses");
+			if (lua_istable(L, -1)) {
+				lua_pushvalue(L, cls);
+				lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+			}
+			lua_pop(L, 1);
 		}
 		
+		//Instances of subclasses are of the same kind as the superclass's, and
+		//have its properties.
+		if (superclass && LuaObject::isClass(L, superclass))
+			LuaObject::makeClass(L, cls);
+		if (superclass)
+			LuaObject::inheritProperties(L, cls, superclass);
+		
+		//Create the bookkeeping information.
+		LuaClassInfo * info = (LuaClassInfo *)lua_newuserdata(L, sizeof(LuaClassInfo));
+		info->version = 0;
+		info->flattening = LuaClassInfo::NOT_FLATTENED;
+		info->instances = 0;
+		info->hooksVersion = 0;
+		info->hooksKnown = 0;
+		info->hooksPresent = 0;
+		lua_pushvalue(L, cls);
+		info->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		lua_setfield(L, cls, "__info");
+		lua_newtable(L);
+		lua_setfield(L, cls, "__subclasses");
+		
+		//Route reads of the class table to the method table and writes through
+		//the setField function.
+		lua_newtable(L);
+		lua_insert(L, -2);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lua_setField);
+		lua_setfield(L, -2, "__newindex");
+		lua_setmetatable(L, cls);
+		
+		//Subclasses of flattened classes are flattened as well.
+		LuaClassInfo * super = (superclass ? LuaClass::info(L, superclass) : NULL);
+		if (super && super->flattening != LuaClassInfo::NOT_FLATTENED)
+			flatten(L, cls, super->flattening == LuaClassInfo::FLATTENED_LAZILY);
+		
 		//Move the class table into the global namespace.
 		lua_pushvalue(L, -1);
 		lua_setglobal(L, className);
 	}
 	
+	/** Returns the bookkeeping information of the class table at the given
+	 index, or NULL if the table is no class created by make. */
+	static LuaClassInfo * info(lua_State * L, int index)
+	{
+		if (!lua_istable(L, index))
+			return NULL;
+		lua_getfield(L, index, "__info");
+		LuaClassInfo * info = (LuaClassInfo *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		return info;
+	}
+	
+	/** Returns whether the given class implements the hook, itself or through
+	 a superclass. The answer is cached in the class until it or one of its
+	 superclasses is modified, which bumps its version, so methods defined by
+	 scripts at any time are noticed. As with LuaMethod, functions stored in
+	 individual instances are not seen. */
+	static bool implements(lua_State * L, LuaClassInfo * cls, const LuaHook & hook)
+	{
+		if (cls->hooksVersion != cls->version) {
+			cls->hooksVersion = cls->version;
+			cls->hooksKnown = 0;
+			cls->hooksPresent = 0;
+		}
+		uint64_t mask = (hook.bit >= 0 ? (uint64_t)1 << hook.bit : 0);
+		if (cls->hooksKnown & mask)
+			return (cls->hooksPresent & mask) != 0;
+		
+		lua_rawgeti(L, LUA_REGISTRYINDEX, cls->ref);
+		lua_getfield(L, -1, hook.name);
+		bool found = lua_isfunction(L, -1);
+		lua_pop(L, 2);
+		cls->hooksKnown |= mask;
+		if (found)
+			cls->hooksPresent |= mask;
+		return found;
+	}
+	
+	/** Pushes an array of the instances of exposed objects created as the
+	 class table at the given index, not including its subclasses. Only live
+	 objects are enumerated, through the identity map rather than the heap. */
+	static void pushInstances(lua_State * L, int index)
+	{
+		LuaClassInfo * cls = info(L, index);
+		LuaObject::pushInstancesOf(L, index, (cls ? (int)cls->instances : 0));
+	}
+	
+	/** Marks the class table at the given index and all of its subclasses as
+	 modified. Call this after changing a class table without going through
+	 its metatable, e.g. using lua_rawset. */
+	static void touch(lua_State * L, int index)
+	{
+		if (index < 0)
+			index += lua_gettop(L) + 1;
+		
+		//Make room for the recursion into the subclasses.
+		lua_checkstack(L, 4);
+		
+		LuaClassInfo * cls = info(L, index);
+		if (cls)
+			cls->version++;
+		
+		lua_getfield(L, index, "__subclasses");
+		if (lua_istable(L, -1)) {
+			int n = lua_objlen(L, -1);
+			for (int i = 1; i <= n; i++) {
+				lua_rawgeti(L, -1, i);
+				touch(L, -1);
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+	
+	/** Reloads the class script at the given path and patches the changes into
+	 the live class tables. The script is run in a scratch environment in which
+	 existing classes are replaced by empty tables collecting the methods the
+	 script defines. Afterwards, new and changed methods are assigned to the
+	 real classes, and methods which the script used to define but no longer
+	 does are removed. Classes the script defines for the first time are
+	 created as usual, and other globals it assigns are copied over.
+	 
+	 The class tables keep their identity, so existing instances keep their
+	 fields and see the new methods right away. Assignments go through the
+	 class tables' metatables, which invalidates cached method resolutions and
+	 updates flattened subclasses. The cost depends on the size of the script
+	 and the classes it touches, not on the number of instances. Superclasses
+	 of existing classes are not changed.
+	 
+	 Nothing is patched if the script fails to load or run. Returns whether the
+	 reload succeeded. */
+	static bool reload(lua_State * L, const char * path)
+	{
+		lua_checkstack(L, 12);
+		int top = lua_gettop(L);
+		lua_getglobal(L, "stacktrace");
+		int trace = top + 1;
+		
+		//Load the script, preferring the file over an embedded copy.
+		int error;
+		struct stat st;
+		if (stat(path, &st) == 0) {
+			LuaBytecodeCache * cache = LuaState::getBytecodeCache(L);
+			error = (cache ? cache->load(L, path) : luaL_loadfile(L, path));
+		} else {
+			error = LuaEmbedded::load(L, path);
+			if (error < 0)
+				error = luaL_loadfile(L, path);
+		}
+		if (error) {
+			lua_replace(L, top + 1);
+			LuaError::report(L);
+			return false;
+		}
+		int chunk = lua_gettop(L);
+		
+		//Set up the scratch environment. Existing classes are mapped to
+		//scratch tables, the reverse table maps them back.
+		lua_newtable(L);
+		int scratch = lua_gettop(L);
+		lua_newtable(L);
+		int reverse = lua_gettop(L);
+		lua_newtable(L);
+		int env = lua_gettop(L);
+		lua_newtable(L);
+		lua_pushvalue(L, scratch);
+		lua_pushvalue(L, reverse);
+		lua_pushcclosure(L, lua_reloadIndex, 2);
+		lua_setfield(L, -2, "__index");
+		lua_setmetatable(L, env);
+		
+		//Replace the class table by one of the same shape as install builds,
+		//such that both class(...) and class:defineClass(...) work.
+		lua_newtable(L);
+		lua_pushvalue(L, reverse);
+		lua_pushcclosure(L, lua_reloadClass, 1);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, "defineClass");
+		lua_newtable(L);
+		lua_insert(L, -2);
+		lua_setfield(L, -2, "__call");
+		lua_setmetatable(L, -2);
+		lua_setfield(L, env, "class");
+		
+		//Run the script.
+		lua_pushvalue(L, env);
+		lua_setfenv(L, chunk);
+		lua_pushvalue(L, chunk);
+		if (lua_pcall(L, 0, 0, trace) != 0) {
+			lua_replace(L, top + 1);
+			lua_settop(L, top + 1);
+			LuaError::report(L);
+			return false;
+		}
+		
+		//Copy the globals the script assigned.
+		lua_pushnil(L);
+		lua_setfield(L, env, "class");
+		for (lua_pushnil(L); lua_next(L, env); lua_pop(L, 1)) {
+			lua_pushvalue(L, -2);
+			lua_pushvalue(L, -2);
+			lua_settable(L, LUA_GLOBALSINDEX);
+		}
+		
+		//Patch the classes.
+		lua_pushfstring(L, "@%s", path);
+		const char * source = lua_tostring(L, -1);
+		for (lua_pushnil(L); lua_next(L, reverse); lua_pop(L, 1))
+			patch(L, lua_gettop(L), lua_gettop(L) - 1, source);
+		
+		lua_settop(L, top);
+		return true;
+	}
+	
 	/** Same as make, but looks up the superclass by its name. */
 	static void make(lua_State * L, const char * className,
 					 const char * superclass)
@@ -71,7 +420,496 @@ public:
 		lua_pop(L, 1);
 	}
 	
+	/** Flattens the class table at the given index and all of its subclasses.
+	 Methods inherited from the superclasses are copied into the method table
+	 of the class, such that looking up a method costs the same regardless of
+	 the depth of the class hierarchy. Methods are either copied right away or,
+	 if lazy is true, the first time they are looked up in the class.
+	 
+	 The copies are tracked in the class's __inherited table. Assignments to a
+	 superclass update or drop the copies in its flattened subclasses, unless
+	 the subclass implements the method itself. Classes derived from a flat-
+	 tened class are flattened as well. */
+	static void flatten(lua_State * L, int index, bool lazy = false)
+	{
+		if (index < 0)
+			index += lua_gettop(L) + 1;
+		LuaClassInfo * cls = info(L, index);
+		if (!cls)
+			return;
+		lua_checkstack(L, 12);
+		cls->flattening = (lazy ? LuaClassInfo::FLATTENED_LAZILY : LuaClassInfo::FLATTENED);
+		
+		//Create the table that tracks the copied methods.
+		lua_getfield(L, index, "__inherited");
+		if (!lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushliteral(L, "__inherited");
+			lua_pushvalue(L, -2);
+			lua_rawset(L, index);
+		}
+		int inherited = lua_gettop(L);
+		lua_getfield(L, index, "__methods");
+		int methods = lua_gettop(L);
+		
+		//Find the superclass's method table, which is the __index of the
+		//metatable of the method table. It might be the lazy copy closure
+		//already, in which case the super table is its first upvalue.
+		if (lua_getmetatable(L, methods)) {
+			lua_getfield(L, -1, "__index");
+			if (lua_iscfunction(L, -1)) {
+				lua_getupvalue(L, -1, 1);
+				lua_replace(L, -2);
+			}
+			int super = lua_gettop(L);
+			
+			if (lazy) {
+				//Replace the __index by the closure that copies on first use.
+				lua_pushvalue(L, super);
+				lua_pushvalue(L, inherited);
+				lua_pushcclosure(L, lua_copyDown, 2);
+				lua_setfield(L, super - 1, "__index");
+			} else {
+				//Copy the methods of the superclasses, nearest ones first.
+				lua_pushvalue(L, super);
+				lua_setfield(L, super - 1, "__index");
+				lua_pushvalue(L, super);
+				while (lua_istable(L, -1)) {
+					for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) {
+						lua_pushvalue(L, -2);
+						lua_rawget(L, methods);
+						bool defined = !lua_isnil(L, -1);
+						lua_pop(L, 1);
+						if (defined)
+							continue;
+						lua_pushvalue(L, -2);
+						lua_pushvalue(L, -2);
+						lua_rawset(L, methods);
+						lua_pushvalue(L, -2);
+						lua_pushboolean(L, 1);
+						lua_rawset(L, inherited);
+					}
+					if (!lua_getmetatable(L, -1)) {
+						lua_pop(L, 1);
+						break;
+					}
+					lua_getfield(L, -1, "__index");
+					if (lua_iscfunction(L, -1)) {
+						lua_getupvalue(L, -1, 1);
+						lua_replace(L, -2);
+					}
+					lua_replace(L, -3);
+					lua_pop(L, 1);
+				}
+			}
+		}
+		lua_settop(L, inherited - 1);
+		
+		//Flatten the subclasses.
+		lua_getfield(L, index, "__subclasses");
+		if (lua_istable(L, -1)) {
+			int n = lua_objlen(L, -1);
+			for (int i = 1; i <= n; i++) {
+				lua_rawgeti(L, -1, i);
+				flatten(L, -1, lazy);
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+	
 private:
+	/** Updates the copies of the method with the key on top of the stack in
+	 the subclasses of the class table at the given index, after the method has
+	 been assigned in the class. */
+	static void inherit(lua_State * L, int index)
+	{
+		lua_checkstack(L, 12);
+		int key = lua_gettop(L);
+		lua_getfield(L, index, "__subclasses");
+		if (!lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			return;
+		}
+		int n = lua_objlen(L, -1);
+		for (int i = 1; i <= n; i++) {
+			lua_rawgeti(L, key + 1, i);
+			int sub = lua_gettop(L);
+			LuaClassInfo * cls = info(L, sub);
+			
+			//Flattened subclasses drop their copy of the method and copy it
+			//anew, unless they implement the method themselves.
+			if (cls && cls->flattening != LuaClassInfo::NOT_FLATTENED) {
+				lua_getfield(L, sub, "__methods");
+				lua_getfield(L, sub, "__inherited");
+				lua_pushvalue(L, key);
+				lua_rawget(L, -3);
+				bool own = !lua_isnil(L, -1);
+				lua_pop(L, 1);
+				lua_pushvalue(L, key);
+				lua_rawget(L, -2);
+				bool copied = lua_toboolean(L, -1);
+				lua_pop(L, 1);
+				if (own && !copied) {
+					lua_settop(L, sub - 1);
+					continue;
+				}
+				
+				lua_pushvalue(L, key);
+				lua_pushnil(L);
+				lua_rawset(L, -3);
+				lua_pushvalue(L, key);
+				lua_pushnil(L);
+				lua_rawset(L, -4);
+				if (cls->flattening == LuaClassInfo::FLATTENED) {
+					lua_pushvalue(L, key);
+					lua_gettable(L, -3);
+					if (!lua_isnil(L, -1)) {
+						lua_pushvalue(L, key);
+						lua_pushvalue(L, -2);
+						lua_rawset(L, -5);
+						lua_pushvalue(L, key);
+						lua_pushboolean(L, 1);
+						lua_rawset(L, -4);
+					}
+				}
+				lua_settop(L, sub);
+			}
+			
+			//Pass the change on to the subclass's subclasses.
+			lua_pushvalue(L, key);
+			inherit(L, sub);
+			lua_settop(L, sub - 1);
+		}
+		lua_settop(L, key);
+	}
+	
+	/** __index closure of the method table of lazily flattened classes. The
+	 superclass's method table and the class's __inherited table are its up-
+	 values. Copies the looked up method into the method table. */
+	static int lua_copyDown(lua_State * L)
+	{
+		lua_settop(L, 2);
+		lua_pushvalue(L, 2);
+		lua_gettable(L, lua_upvalueindex(1));
+		if (!lua_isnil(L, -1)) {
+			lua_pushvalue(L, 2);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, 1);
+			lua_pushvalue(L, 2);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, lua_upvalueindex(2));
+		}
+		return 1;
+	}
+	
+	/** Metamethod handling assignments to a class table. Fields starting with
+	 two underscores are stored in the class table itself, since they act as
+	 metamethods of the instances. Everything else goes into the method table.
+	 Either way the class and its subclasses are marked as modified. */
+	static int lua_setField(lua_State * L)
+	{
+		const char * key = (lua_type(L, 2) == LUA_TSTRING ? lua_tostring(L, 2) : NULL);
+		if (key && key[0] == '_' && key[1] == '_') {
+			lua_settop(L, 3);
+			lua_rawset(L, 1);
+		} else {
+			lua_settop(L, 3);
+			lua_getfield(L, 1, "__methods");
+			lua_pushvalue(L, 2);
+			lua_pushvalue(L, 3);
+			lua_rawset(L, 4);
+			
+			//Keep the copies of flattened classes up to date. The method is
+			//no longer inherited by this class, unless it was just removed.
+			LuaClassInfo * cls = info(L, 1);
+			if (cls && cls->flattening != LuaClassInfo::NOT_FLATTENED) {
+				lua_getfield(L, 1, "__inherited");
+				lua_pushvalue(L, 2);
+				lua_pushnil(L);
+				lua_rawset(L, 5);
+				if (lua_isnil(L, 3) && cls->flattening == LuaClassInfo::FLATTENED) {
+					lua_pushvalue(L, 2);
+					lua_gettable(L, 4);
+					if (!lua_isnil(L, -1)) {
+						lua_pushvalue(L, 2);
+						lua_pushvalue(L, -2);
+						lua_rawset(L, 4);
+						lua_pushvalue(L, 2);
+						lua_pushboolean(L, 1);
+						lua_rawset(L, 5);
+					}
+				}
+			}
+			lua_settop(L, 2);
+			inherit(L, 1);
+		}
+		touch(L, 1);
+		return 0;
+	}
+	
+	/** Assigns the methods collected in the scratch table at index from to the
+	 class table at index to, and removes the methods defined in the given
+	 source which the scratch table lacks. */
+	static void patch(lua_State * L, int to, int from, const char * source)
+	{
+		lua_checkstack(L, 8);
+		lua_getfield(L, to, "__methods");
+		int methods = lua_gettop(L);
+		lua_getfield(L, to, "__inherited");
+		int inherited = lua_gettop(L);
+		
+		//Assign new and changed methods.
+		for (lua_pushnil(L); lua_next(L, from); lua_pop(L, 1)) {
+			lua_pushvalue(L, -2);
+			lua_rawget(L, methods);
+			bool same = lua_rawequal(L, -1, -2);
+			lua_pop(L, 1);
+			if (same)
+				continue;
+			lua_pushvalue(L, -2);
+			lua_pushvalue(L, -2);
+			lua_settable(L, to);
+		}
+		
+		//Remove methods the script no longer defines. Copies inherited from a
+		//superclass are left alone.
+		for (lua_pushnil(L); lua_next(L, methods); lua_pop(L, 1)) {
+			if (!lua_isfunction(L, -1) || lua_iscfunction(L, -1))
+				continue;
+			lua_pushvalue(L, -2);
+			lua_rawget(L, from);
+			bool kept = !lua_isnil(L, -1);
+			lua_pop(L, 1);
+			if (kept)
+				continue;
+			if (lua_istable(L, inherited)) {
+				lua_pushvalue(L, -2);
+				lua_rawget(L, inherited);
+				kept = lua_toboolean(L, -1);
+				lua_pop(L, 1);
+				if (kept)
+					continue;
+			}
+			lua_Debug ar;
+			lua_pushvalue(L, -1);
+			lua_getinfo(L, ">S", &ar);
+			if (strcmp(ar.source, source) != 0)
+				continue;
+			
+			//Removing a key while traversing is allowed by lua_next.
+			lua_pushvalue(L, -2);
+			lua_pushnil(L);
+			lua_settable(L, to);
+		}
+		lua_settop(L, methods - 1);
+	}
+	
+	/** __index metamethod of the scratch environment of reload. Hands out a
+	 scratch table for every existing class, whose reads fall back to the real
+	 class. Upvalues are the scratch and reverse tables. */
+	static int lua_reloadIndex(lua_State * L)
+	{
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+		if (!lua_isnil(L, -1))
+			return 1;
+		lua_pop(L, 1);
+		
+		lua_pushvalue(L, 2);
+		lua_gettable(L, LUA_GLOBALSINDEX);
+		if (!info(L, -1))
+			return 1;
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_pushvalue(L, -3);
+		lua_setfield(L, -2, "__index");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, 2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, lua_upvalueindex(1));
+		lua_pushvalue(L, -1);
+		lua_pushvalue(L, -3);
+		lua_rawset(L, lua_upvalueindex(2));
+		return 1;
+	}
+	
+	/** Replacement of defineClass in the scratch environment of reload, taking
+	 the same arguments. Creates classes which do not exist yet and ignores the
+	 others. Upvalue is the reverse table mapping scratch tables to classes. */
+	static int lua_reloadClass(lua_State * L)
+	{
+		const char * className = luaL_checkstring(L, 2);
+		lua_getglobal(L, className);
+		bool exists = (info(L, -1) != NULL);
+		lua_pop(L, 1);
+		if (exists)
+			return 0;
+		
+		int superclass = 0;
+		if (lua_gettop(L) >= 3) {
+			luaL_checktype(L, 3, LUA_TTABLE);
+			lua_pushvalue(L, 3);
+			lua_rawget(L, lua_upvalueindex(1));
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				lua_pushvalue(L, 3);
+			}
+			superclass = lua_gettop(L);
+		}
+		make(L, className, superclass);
+		return 0;
+	}
+	
+	/** Registry of the classes to be autoloaded, see autoload. Pushes the
+	 registry table, which holds the entries under classes, the scripts run so
+	 far under scripts and the counters under stats. If create is false and
+	 there is no registry, pushes nil. Creating the registry hooks it into the
+	 globals table. */
+	static void pushAutoload(lua_State * L, bool create)
+	{
+		lua_pushlightuserdata(L, (void *)&lua_autoload);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		if (!lua_isnil(L, -1) || !create)
+			return;
+		lua_pop(L, 1);
+		
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_setfield(L, -2, "classes");
+		lua_newtable(L);
+		lua_setfield(L, -2, "scripts");
+		AutoloadStats * stats = (AutoloadStats *)lua_newuserdata(L, sizeof(AutoloadStats));
+		stats->registered = 0;
+		stats->materialized = 0;
+		lua_setfield(L, -2, "stats");
+		lua_pushlightuserdata(L, (void *)&lua_autoload);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+		
+		//Hook into the globals table, falling back to its former __index.
+		if (!lua_getmetatable(L, LUA_GLOBALSINDEX)) {
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_setmetatable(L, LUA_GLOBALSINDEX);
+		}
+		lua_getfield(L, -1, "__index");
+		lua_pushvalue(L, -3);
+		lua_pushcclosure(L, lua_autoload, 2);
+		lua_setfield(L, -2, "__index");
+		lua_pop(L, 1);
+	}
+	
+	/** Removes the autoload entries of classes which have been defined in the
+	 meantime, e.g. by a script shared by several classes, and counts them as
+	 materialized. Expects the registry table at the given index. */
+	static void dropDefined(lua_State * L, int autoload)
+	{
+		lua_getfield(L, autoload, "stats");
+		AutoloadStats * stats = (AutoloadStats *)lua_touserdata(L, -1);
+		lua_getfield(L, autoload, "classes");
+		lua_pushnil(L);
+		while (lua_next(L, -2)) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_rawget(L, LUA_GLOBALSINDEX);
+			bool defined = !lua_isnil(L, -1);
+			lua_pop(L, 1);
+			if (defined) {
+				lua_pushvalue(L, -1);
+				lua_pushnil(L);
+				lua_rawset(L, -4);
+				stats->materialized++;
+			}
+		}
+		lua_pop(L, 2);
+	}
+	
+	/** __index metamethod of the globals table which loads registered classes
+	 on first access. Upvalues are the former __index and the autoload registry
+	 table. */
+	static int lua_autoload(lua_State * L)
+	{
+		const int autoload = lua_upvalueindex(2);
+		if (lua_type(L, 2) == LUA_TSTRING) {
+			lua_getfield(L, autoload, "classes");
+			lua_pushvalue(L, 2);
+			lua_rawget(L, -2);
+			if (lua_istable(L, -1)) {
+				int entry = lua_gettop(L);
+				
+				//Remove the entry first, so accessing the class while it loads
+				//does not recurse.
+				lua_pushvalue(L, 2);
+				lua_pushnil(L);
+				lua_rawset(L, -4);
+				
+				//Expose the C++ side of the class.
+				lua_getfield(L, entry, "expose");
+				Exposer expose = (Exposer)lua_touserdata(L, -1);
+				lua_pop(L, 1);
+				if (expose) {
+					expose(L);
+					lua_settop(L, entry);
+				}
+				
+				//Run the script unless it already ran for another class.
+				lua_getfield(L, entry, "script");
+				if (lua_isstring(L, -1)) {
+					lua_getfield(L, autoload, "scripts");
+					lua_pushvalue(L, -2);
+					lua_rawget(L, -2);
+					bool ran = lua_toboolean(L, -1);
+					lua_pop(L, 1);
+					if (!ran) {
+						lua_pushvalue(L, -2);
+						lua_pushboolean(L, 1);
+						lua_rawset(L, -3);
+						lua_cpcall(L, lua_runScript, (void *)lua_tostring(L, -2));
+					}
+				}
+				lua_settop(L, entry);
+				
+				dropDefined(L, autoload);
+				lua_pushvalue(L, 2);
+				lua_rawget(L, 1);
+				if (!lua_isnil(L, -1)) {
+					lua_getfield(L, autoload, "stats");
+					((AutoloadStats *)lua_touserdata(L, -1))->materialized++;
+					lua_pop(L, 1);
+					return 1;
+				}
+				std::cerr << "objlua: *** Autoloading class " << lua_tostring(L, 2)
+				<< " did not define it.\n";
+			}
+			lua_settop(L, 2);
+		}
+		
+		//Fall back to the former __index of the globals table.
+		lua_pushvalue(L, lua_upvalueindex(1));
+		if (lua_isfunction(L, -1)) {
+			lua_insert(L, 1);
+			lua_call(L, 2, 1);
+			return 1;
+		}
+		if (lua_istable(L, -1)) {
+			lua_pushvalue(L, 2);
+			lua_gettable(L, -2);
+			return 1;
+		}
+		lua_pushnil(L);
+		return 1;
+	}
+	
+	/** Runs the script whose path is passed as light userdata. Called through
+	 lua_cpcall, so the script runs on a clean stack. */
+	static int lua_runScript(lua_State * L)
+	{
+		LuaState::dofile(L, (const char *)lua_touserdata(L, 1));
+		return 0;
+	}
+	
 	/** Lua function to define a class. Takes the class name and optionally the
 	 superclass table as arguments. Leaves nothing on the stack. */
 	static int lua_defineClass(lua_State * L)
@@ -1,27 +1,62 @@
 #pragma once
 #include "lua.h"
+#include <cstdio>
+#include <cstring>
 #include <sstream>
 #include <string>
+#include <unordered_set>
 
 
 class LuaDescribe {
 public:
+	/** Bounds on the output of a description, which keep describing large or
+	 deeply nested tables within bounded time and memory. Output beyond a
+	 limit is replaced by an ellipsis. */
+	struct Limits {
+		/** Deepest level of nested tables that is expanded. */
+		int depth;
+		/** Number of table entries described in total. */
+		size_t entries;
+		/** Number of bytes written in total. */
+		size_t bytes;
+		
+		Limits(int depth = 16, size_t entries = 10000, size_t bytes = 1 << 20)
+		: depth(depth), entries(entries), bytes(bytes) {}
+	};
+	
+	/** Writes the description of the stack item at the given index to the
+	 stream. Tables are expanded with the given indentation level. Tables that
+	 have been described before, e.g. because a table contains itself, are
+	 only referred to. */
+	static void write(std::ostream & out, lua_State * L, int index,
+					  const Limits & limits = Limits(), int indent = 0)
+	{
+		Writer w(&out, NULL, limits);
+		w.generic(L, index, indent);
+	}
+	
+	/** Same as above, but appends the description to the given string. */
+	static void write(std::string & out, lua_State * L, int index,
+					  const Limits & limits = Limits(), int indent = 0)
+	{
+		Writer w(NULL, &out, limits);
+		w.generic(L, index, indent);
+	}
+	
 	/** Describes a string. */
 	static std::string string(lua_State * L, int index)
 	{
-		std::stringstream s;
-		s << "\"";
-		s << lua_tostring(L, index);
-		s << "\"";
-		return s.str();
+		std::string s;
+		write(s, L, index);
+		return s;
 	}
 	
 	/** Describes a number. */
 	static std::string number(lua_State * L, int index)
 	{
-		std::stringstream s;
-		s << lua_tonumber(L, index);
-		return s.str();
+		std::string s;
+		write(s, L, index);
+		return s;
 	}
 	
 	/** Describes a boolean. */
@@ -34,56 +69,156 @@ public:
 	static std::string table(lua_State * L, int index,
 							 int indent = 0)
 	{
-		if (index < 0) index += lua_gettop(L) + 1;
-		std::stringstream s;
-		std::string pad((indent + 1) * 4, ' ');
-		s << "{\n";
-		for (lua_pushnil(L); lua_next(L, index); lua_pop(L, 1)) {
-			
-			//Copy the key to the top of the stack, since luaL_checkstring
-			//messes with it which would break lua_next if it did so in-place.
-			lua_pushvalue(L, -2);
-			const char * key = lua_tostring(L, -1);
-			lua_pop(L, 1);
-			
-			//Add the entry description.
-			s << pad << key << " = ";
-			if (std::string(key) == "__index")
-				s << "...";
-			else
-				s << generic(L, lua_type(L, -1), -1,
-							 indent + 1);
-			s << "\n";
-		}
-		s << std::string(indent * 4, ' ') << "}";
-		return s.str();
+		std::string s;
+		write(s, L, index, Limits(), indent);
+		return s;
 	}
 	
 	
-	/** Calls the appropriate description function for the given type of item. */
-	static std::string generic(lua_State * L, int type, int index,
-							   int indent = 0)
-	{
-		switch (type) {
-			case LUA_TSTRING: return string(L, index);
-			case LUA_TNUMBER: return number(L, index);
-			case LUA_TBOOLEAN: return boolean(L, index);
-			case LUA_TTABLE:  return table(L, index, indent);
-		}
-		
-		//Fallback if we're unable to describe the given type.
-		std::stringstream s;
-		s << "<";
-		s << lua_typename(L, type);
-		s << " @";
-		s << index;
-		s << ">";
-		return s.str();
-	}
-	
 	/** Returns the description of the stack item at the given index. */
-	static std::string generic(lua_State * L, int index)
+	static std::string generic(lua_State * L, int index, int indent = 0)
 	{
-		return generic(L, lua_type(L, index), index);
+		std::string s;
+		write(s, L, index, Limits(), indent);
+		return s;
 	}
+	
+private:
+	/** Writes a single description into a stream or string, keeping track of
+	 the limits and the tables described so far. */
+	class Writer {
+	public:
+		Writer(std::ostream * stream, std::string * buffer, const Limits & limits)
+		: stream(stream), buffer(buffer), limits(limits), written(0), entries(0),
+		  truncated(false) {}
+		
+		/** Describes the item at the given index. */
+		void generic(lua_State * L, int index, int indent)
+		{
+			if (index < 0)
+				index += lua_gettop(L) + 1;
+			int type = lua_type(L, index);
+			switch (type) {
+				case LUA_TSTRING: {
+					size_t length;
+					const char * s = lua_tolstring(L, index, &length);
+					put("\"");
+					put(s, length);
+					put("\"");
+				} break;
+				case LUA_TNUMBER: {
+					char s[32];
+					snprintf(s, sizeof(s), LUA_NUMBER_FMT, (double)lua_tonumber(L, index));
+					put(s);
+				} break;
+				case LUA_TBOOLEAN: put(lua_toboolean(L, index) ? "true" : "false"); break;
+				case LUA_TTABLE: table(L, index, indent); break;
+				default: fallback(L, type, index); break;
+			}
+		}
+	
+	private:
+		std::ostream * stream;
+		std::string * buffer;
+		Limits limits;
+		size_t written;
+		size_t entries;
+		bool truncated;
+		/** Tables currently being described, i.e. the enclosing ones. */
+		std::unordered_set<const void *> visited;
+		
+		void put(const char * s) { put(s, strlen(s)); }
+		void put(const char * s, size_t length)
+		{
+			if (truncated)
+				return;
+			if (written + length > limits.bytes) {
+				length = limits.bytes - written;
+				truncated = true;
+			}
+			if (stream)
+				stream->write(s, length);
+			else
+				buffer->append(s, length);
+			written += length;
+			if (truncated) {
+				if (stream)
+					*stream << "...";
+				else
+					buffer->append("...");
+			}
+		}
+		void pad(int indent)
+		{
+			for (int i = 0; i < indent; i++)
+				put("    ");
+		}
+		
+		/** Describes types that have no textual representation. */
+		void fallback(lua_State * L, int type, int index)
+		{
+			char s[64];
+			snprintf(s, sizeof(s), "<%s @%d>", lua_typename(L, type), index);
+			put(s);
+		}
+		
+		void table(lua_State * L, int index, int indent)
+		{
+			//Refer to enclosing tables instead of describing them again, which
+			//breaks cycles. Tables shared by several entries are described for
+			//each of them.
+			const void * p = lua_topointer(L, index);
+			if (visited.count(p)) {
+				char s[64];
+				snprintf(s, sizeof(s), "<table %p>", p);
+				put(s);
+				return;
+			}
+			if (indent >= limits.depth || !lua_checkstack(L, 3)) {
+				put("{...}");
+				return;
+			}
+			visited.insert(p);
+			
+			put("{\n");
+			for (lua_pushnil(L); lua_next(L, index); lua_pop(L, 1)) {
+				if (truncated || entries >= limits.entries) {
+					pad(indent + 1);
+					put("...\n");
+					lua_pop(L, 2);
+					break;
+				}
+				entries++;
+				
+				//Describe the key. Strings and numbers are converted on a copy,
+				//since lua_tostring would break lua_next if done in place.
+				pad(indent + 1);
+				int keyType = lua_type(L, -2);
+				bool isIndex = false;
+				if (keyType == LUA_TSTRING || keyType == LUA_TNUMBER) {
+					lua_pushvalue(L, -2);
+					size_t length;
+					const char * key = lua_tolstring(L, -1, &length);
+					put(key, length);
+					isIndex = (keyType == LUA_TSTRING && strcmp(key, "__index") == 0);
+					lua_pop(L, 1);
+				} else {
+					char s[64];
+					snprintf(s, sizeof(s), "[<%s %p>]", lua_typename(L, keyType), lua_topointer(L, -2));
+					put(s);
+				}
+				put(" = ");
+				
+				//Describe the value.
+				if (isIndex)
+					put("...");
+				else
+					generic(L, lua_gettop(L), indent + 1);
+				put("\n");
+			}
+			pad(indent);
+			put("}");
+			visited.erase(p);
+		}
+	};
 };
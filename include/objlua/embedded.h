@@ -0,0 +1,141 @@
+#pragma once
+#include <cstring>
+#include <vector>
+#include "lua.h"
+
+
+/** A precompiled script embedded into the binary. */
+struct LuaEmbeddedScript {
+	/** Name the script is found under, i.e. its path relative to the base
+	 directory it was embedded from, e.g. "scripts/sprite.lua". */
+	const char * name;
+	/** The compiled chunk. */
+	const unsigned char * code;
+	size_t size;
+};
+
+
+/** Table of the scripts embedded into the binary through the
+ objlua_embed_scripts CMake function. The generated source registers its
+ scripts before main runs. LuaState::dofile, as well as dofile and require in
+ Lua, resolve names against this table before touching the disk, so loading
+ embedded scripts involves no file I/O.
+
+ Modules are found by require under their name with dots replaced by slashes
+ and .lua appended, i.e. require "scripts.sprite" loads the embedded script
+ scripts/sprite.lua. */
+class LuaEmbedded {
+public:
+	/** Registers the given scripts at static initialization time. */
+	struct Registrar {
+		Registrar(const LuaEmbeddedScript * scripts, size_t count)
+		{
+			for (size_t i = 0; i < count; i++)
+				table().push_back(&scripts[i]);
+		}
+	};
+
+	/** Returns the embedded script with the given name, or NULL if there is
+	 none. */
+	static const LuaEmbeddedScript * find(const char * name)
+	{
+		if (!name)
+			return NULL;
+		std::vector<const LuaEmbeddedScript *> & scripts = table();
+		for (size_t i = 0; i < scripts.size(); i++)
+			if (strcmp(scripts[i]->name, name) == 0)
+				return scripts[i];
+		return NULL;
+	}
+
+	/** Returns the number of embedded scripts. */
+	static size_t count() { return table().size(); }
+
+	/** Loads the embedded script with the given name as a function onto the
+	 stack. Returns -1 and leaves the stack untouched if there is no such
+	 script, otherwise behaves like luaL_loadbuffer. */
+	static int load(lua_State * L, const char * name)
+	{
+		const LuaEmbeddedScript * script = find(name);
+		if (!script)
+			return -1;
+		lua_pushfstring(L, "@%s", name);
+		int error = luaL_loadbuffer(L, (const char *)script->code, script->size, lua_tostring(L, -1));
+		lua_remove(L, -2);
+		return error;
+	}
+
+	/** Makes dofile and require in the given state look for embedded scripts
+	 first. Does nothing if no scripts are embedded. */
+	static void install(lua_State * L)
+	{
+		if (table().empty())
+			return;
+
+		//Wrap dofile, keeping the original one for scripts on disk.
+		lua_getglobal(L, "dofile");
+		lua_pushcclosure(L, lua_dofile, 1);
+		lua_setglobal(L, "dofile");
+
+		//Insert a loader behind the preload loader of require.
+		lua_getglobal(L, "package");
+		if (lua_istable(L, -1)) {
+			lua_getfield(L, -1, "loaders");
+			if (lua_istable(L, -1)) {
+				for (int i = (int)lua_objlen(L, -1); i >= 2; i--) {
+					lua_rawgeti(L, -1, i);
+					lua_rawseti(L, -2, i + 1);
+				}
+				lua_pushcfunction(L, lua_loader);
+				lua_rawseti(L, -2, 2);
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+
+private:
+	static std::vector<const LuaEmbeddedScript *> & table()
+	{
+		static std::vector<const LuaEmbeddedScript *> scripts;
+		return scripts;
+	}
+
+	/** Replacement of dofile which runs embedded scripts and hands anything
+	 else to the original dofile. */
+	static int lua_dofile(lua_State * L)
+	{
+		const char * name = luaL_optstring(L, 1, NULL);
+		int error = load(L, name);
+		if (error < 0) {
+			lua_pushvalue(L, lua_upvalueindex(1));
+			lua_insert(L, 1);
+			lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+			return lua_gettop(L);
+		}
+		if (error)
+			return lua_error(L);
+		int base = lua_gettop(L) - 1;
+		lua_call(L, 0, LUA_MULTRET);
+		return lua_gettop(L) - base;
+	}
+
+	/** Loader for require which looks up modules among the embedded scripts. */
+	static int lua_loader(lua_State * L)
+	{
+		const char * module = luaL_checkstring(L, 1);
+		luaL_gsub(L, module, ".", "/");
+		lua_pushliteral(L, ".lua");
+		lua_concat(L, 2);
+		const char * name = lua_tostring(L, -1);
+		int error = load(L, name);
+		if (error < 0) {
+			lua_pushfstring(L, "\n\tno embedded script '%s'", name);
+			return 1;
+		}
+		if (error)
+			luaL_error(L, "error loading module '%s' from embedded script '%s':\n\t%s",
+					   module, name, lua_tostring(L, -1));
+		return 1;
+	}
+};
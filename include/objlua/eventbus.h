@@ -0,0 +1,348 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "class.h"
+#include "error.h"
+#include "functions.h"
+#include "lua.h"
+#include "object.h"
+#include "value.h"
+
+
+/** Delivers events to the instances subscribed to a bus, calling the method
+ named after the event on each instance whose class implements it. Instances
+ are kept in groups by class, and the bus indexes which groups handle which
+ events, so a broadcast only visits the instances that actually handle the
+ event. Its cost grows with the number of handlers rather than the number of
+ subscribers.
+ 
+ @code
+ LuaEventBus bus(lua);
+ bus.subscribe(sprite);
+ LuaEventBus::Result r = bus.broadcast("onHit", 10, "fire");
+ @endcode
+ 
+ The index is kept per event and is checked against the versions of the
+ subscribed classes on every broadcast, so methods assigned to a class or its
+ superclasses take effect on the next broadcast. As with LuaMethod, handlers
+ are resolved through the class, so functions stored in individual instances
+ are not seen.
+ 
+ Subscriptions are held by the instance and do not keep it alive. Instances
+ of deleted objects are dropped when a broadcast comes across them. Instances
+ subscribed during a broadcast receive events from the next broadcast on.
+ The bus must not outlive the Lua state. */
+class LuaEventBus {
+public:
+	/** Outcome of a broadcast. */
+	struct Result {
+		/** Number of handlers called successfully. */
+		size_t called;
+		/** Number of handlers that raised an error. */
+		size_t failed;
+		
+		Result() : called(0), failed(0) {}
+	};
+	
+	/** Creates an empty bus for the given state. */
+	LuaEventBus(lua_State * L) : L(L), depth(0)
+	{
+		lua_getglobal(L, "stacktrace");
+		trace = luaL_ref(L, LUA_REGISTRYINDEX);
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_setfield(L, -2, "pending");
+		table = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	
+	/** Releases the registry references held by the bus. */
+	~LuaEventBus()
+	{
+		luaL_unref(L, LUA_REGISTRYINDEX, trace);
+		luaL_unref(L, LUA_REGISTRYINDEX, table);
+	}
+	
+	/** Subscribes the instance of the given exposed object to the bus. */
+	template <typename T>
+	bool subscribe(T * object)
+	{
+		object->loadReference();
+		bool result = subscribe(-1);
+		lua_pop(L, 1);
+		return result;
+	}
+	
+	/** Subscribes the instance at the given stack index to the bus. Returns
+	 false if the value is no instance of a class created through
+	 LuaClass::make. */
+	bool subscribe(int index)
+	{
+		if (index < 0)
+			index += lua_gettop(L) + 1;
+		LuaClassInfo * cls = NULL;
+		if (lua_getmetatable(L, index)) {
+			cls = LuaClass::info(L, -1);
+			lua_pop(L, 1);
+		}
+		if (!cls) {
+			std::cerr << "objlua: *** Unable to subscribe to events. Value is no"
+			" instance of a class.\n";
+			return false;
+		}
+		
+		//Adding keys to a group that is being traversed is not allowed, so
+		//subscriptions made during a broadcast wait until it is done.
+		if (depth) {
+			lua_rawgeti(L, LUA_REGISTRYINDEX, table);
+			lua_getfield(L, -1, "pending");
+			lua_pushvalue(L, index);
+			lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+			lua_pop(L, 2);
+			return true;
+		}
+		pushMembers(group(cls));
+		lua_pushvalue(L, index);
+		lua_pushboolean(L, 1);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+		return true;
+	}
+	
+	/** Unsubscribes the instance of the given exposed object from the bus. */
+	template <typename T>
+	void unsubscribe(T * object)
+	{
+		object->loadReference();
+		unsubscribe(-1);
+		lua_pop(L, 1);
+	}
+	
+	/** Unsubscribes the instance at the given stack index from the bus. */
+	void unsubscribe(int index)
+	{
+		if (index < 0)
+			index += lua_gettop(L) + 1;
+		for (Groups::iterator it = groups.begin(); it != groups.end(); ++it) {
+			pushMembers(it->second);
+			lua_pushvalue(L, index);
+			lua_pushnil(L);
+			lua_rawset(L, -3);
+			lua_pop(L, 1);
+		}
+		
+		//Drop pending subscriptions as well.
+		lua_rawgeti(L, LUA_REGISTRYINDEX, table);
+		lua_getfield(L, -1, "pending");
+		int n = lua_objlen(L, -1);
+		for (int i = 1; i <= n; i++) {
+			lua_rawgeti(L, -1, i);
+			if (lua_rawequal(L, -1, index)) {
+				lua_pushboolean(L, 0);
+				lua_rawseti(L, -3, i);
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 2);
+	}
+	
+	/** Calls the method named after the event on every subscribed instance
+	 whose class implements it, passing the given arguments. The arguments are
+	 pushed once for the whole broadcast. Every handler is called in a pro-
+	 tected call of its own, such that an error in one of them is reported
+	 without aborting the rest of the broadcast. Instances are visited grouped
+	 by class, in no particular order. */
+	template <typename... Args>
+	Result broadcast(const char * event, Args &&... args)
+	{
+		Result result;
+		std::vector<Group *> targets = resolve(event);
+		if (targets.empty())
+			return result;
+		
+		const int argc = (int)sizeof...(Args);
+		int base = lua_gettop(L);
+		lua_checkstack(L, argc + 12);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, trace);
+		(LuaValue<typename std::decay<Args>::type>::push(L, args), ...);
+		const int errfunc = base + 1;
+		
+		depth++;
+		for (size_t i = 0; i < targets.size(); i++) {
+			//Look the handler up anew, since an earlier handler may have
+			//modified the class.
+			lua_rawgeti(L, LUA_REGISTRYINDEX, targets[i]->cls->ref);
+			int cls = lua_gettop(L);
+			lua_getfield(L, cls, event);
+			if (!lua_isfunction(L, -1)) {
+				lua_settop(L, cls - 1);
+				continue;
+			}
+			pushMembers(*targets[i]);
+			int members = lua_gettop(L);
+			
+			for (lua_pushnil(L); lua_next(L, members); lua_pop(L, 1)) {
+				//Drop the instances of deleted objects, and move those whose
+				//class has changed to their new group after the broadcast.
+				bool deleted = LuaObject::isDeleted(L, -2);
+				if (deleted || !isInstanceOf(-2, cls)) {
+					if (!deleted)
+						subscribe(-2);
+					lua_pushvalue(L, -2);
+					lua_pushnil(L);
+					lua_rawset(L, members);
+					continue;
+				}
+				lua_pushvalue(L, cls + 1);
+				lua_pushvalue(L, -3);
+				for (int a = 0; a < argc; a++)
+					lua_pushvalue(L, errfunc + 1 + a);
+				if (Lua::pcall(L, event, argc, 0, errfunc) != 0) {
+					LuaError::report(L);
+					result.failed++;
+				} else {
+					result.called++;
+				}
+			}
+			lua_settop(L, cls - 1);
+		}
+		if (--depth == 0)
+			flush();
+		lua_settop(L, base);
+		return result;
+	}
+	
+	/** Returns the number of subscribed instances whose class implements the
+	 method named after the given event. */
+	size_t getSubscribers(const char * event)
+	{
+		std::vector<Group *> targets = resolve(event);
+		size_t count = 0;
+		for (size_t i = 0; i < targets.size(); i++) {
+			pushMembers(*targets[i]);
+			for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1))
+				if (!LuaObject::isDeleted(L, -2))
+					count++;
+			lua_pop(L, 1);
+		}
+		return count;
+	}
+	
+private:
+	LuaEventBus(const LuaEventBus &);
+	LuaEventBus & operator=(const LuaEventBus &);
+	
+	/** Subscribed instances of a single class. */
+	struct Group {
+		LuaClassInfo * cls;
+		/** Reference to the table of the instances in the bus's table. Its
+		 keys are weak. */
+		int members;
+	};
+	
+	/** Groups handling an event, valid as long as no group has been added
+	 and the versions of the classes are the ones they were collected for. */
+	struct Handlers {
+		size_t groups;
+		unsigned long versions;
+		std::vector<Group *> targets;
+	};
+	
+	typedef std::unordered_map<LuaClassInfo *, Group> Groups;
+	typedef std::unordered_map<std::string, Handlers> Index;
+	
+	lua_State * L;
+	/** Registry reference to the stacktrace error handler. */
+	int trace;
+	/** Registry reference to the table holding the groups' instances and the
+	 pending subscriptions. */
+	int table;
+	/** Number of broadcasts currently running. */
+	int depth;
+	Groups groups;
+	Index index;
+	
+	/** Returns the group of the given class, creating it if required. Groups
+	 are never removed, so pointers to them stay valid. */
+	Group & group(LuaClassInfo * cls)
+	{
+		Groups::iterator it = groups.find(cls);
+		if (it != groups.end())
+			return it->second;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, table);
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		Group g = {cls, luaL_ref(L, -2)};
+		lua_pop(L, 1);
+		return groups.insert(std::make_pair(cls, g)).first->second;
+	}
+	
+	void pushMembers(const Group & g)
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, table);
+		lua_rawgeti(L, -1, g.members);
+		lua_remove(L, -2);
+	}
+	
+	/** Returns the groups whose class implements the method named after the
+	 event, collecting them anew if any class has changed since. */
+	std::vector<Group *> & resolve(const char * event)
+	{
+		unsigned long versions = 0;
+		for (Groups::iterator it = groups.begin(); it != groups.end(); ++it)
+			versions += it->first->version;
+		
+		Handlers & h = index[event];
+		if (h.groups == groups.size() && h.versions == versions)
+			return h.targets;
+		
+		h.groups = groups.size();
+		h.versions = versions;
+		h.targets.clear();
+		for (Groups::iterator it = groups.begin(); it != groups.end(); ++it) {
+			lua_rawgeti(L, LUA_REGISTRYINDEX, it->first->ref);
+			lua_getfield(L, -1, event);
+			if (lua_isfunction(L, -1))
+				h.targets.push_back(&it->second);
+			lua_pop(L, 2);
+		}
+		return h.targets;
+	}
+	
+	/** Returns whether the value at the given index has the class table at
+	 index cls as its metatable. */
+	bool isInstanceOf(int index, int cls)
+	{
+		if (!lua_getmetatable(L, index))
+			return false;
+		bool result = lua_rawequal(L, -1, cls);
+		lua_pop(L, 1);
+		return result;
+	}
+	
+	/** Adds the subscriptions made during the broadcast to their groups. */
+	void flush()
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, table);
+		lua_getfield(L, -1, "pending");
+		if (lua_objlen(L, -1) == 0) {
+			lua_pop(L, 2);
+			return;
+		}
+		lua_newtable(L);
+		lua_setfield(L, -3, "pending");
+		int n = lua_objlen(L, -1);
+		for (int i = 1; i <= n; i++) {
+			lua_rawgeti(L, -1, i);
+			if (lua_toboolean(L, -1))
+				subscribe(-1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 2);
+	}
+};
@@ -1,11 +1,62 @@
 #pragma once
 #include <cassert>
 #include <cstdarg>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "class.h"
 #include "error.h"
 #include "lua.h"
 #include "stack.h"
 #include "state.h"
 #include "functions.h"
+#include "method.h"
+#include "object.h"
+#include "pool.h"
+
+
+/** Determines which side controls the lifetime of an exposed object. */
+enum LuaOwnership {
+	/** The C++ side deletes the object, or a script calls delete. The Lua in-
+	 stance is kept alive until then. */
+	LUA_PINNED,
+	/** The object is deleted when its Lua instance is garbage collected. */
+	LUA_OWNED_BY_LUA,
+	/** The C++ side deletes the object. The Lua instance is only referenced
+	 weakly and may be collected, in which case a fresh one is created the next
+	 time the object is pushed onto the stack. */
+	LUA_OWNED_BY_CPP,
+	/** The object lives as long as either side uses it. While the C++ side
+	 holds it through retain, the Lua instance is kept alive. Otherwise the
+	 object is deleted when its Lua instance is collected. */
+	LUA_SHARED
+};
+
+
+/** Default options of exposed classes. */
+struct LuaExposableDefaults {
+	/** Ownership of new objects, which may be changed per object. */
+	static const LuaOwnership ownership = LUA_PINNED;
+	/** If true, instances are represented in Lua as a single userdata rather
+	 than a table with a __this userdata. This saves an allocation per object
+	 and a field lookup per method call. Fields assigned to such instances are
+	 kept in a table that is only created on the first assignment. */
+	static const bool userdata = false;
+	/** If true, objects created through new (L) T(L), including those created
+	 by scripts, are allocated from a pool per class and state which recycles
+	 their memory. Pooled objects are deleted when their state is closed. */
+	static const bool pooled = false;
+};
+
+/** Options of the exposed class T. Specialize this template, deriving from
+ LuaExposableDefaults, to change them for a class.
+ 
+ @code
+ template <> struct LuaExposableTraits<Sprite> : LuaExposableDefaults {
+	 static const bool userdata = true;
+ };
+ @endcode */
+template <typename T> struct LuaExposableTraits : LuaExposableDefaults {};
 
 
 /** All the objects that are likely to be exposed to Lua should inherit from
@@ -25,50 +76,192 @@ public:
 			{NULL, NULL}
 		};
 		luaL_register(L, 0, functions);
+		
+		//Switch the class to userdata instances if requested.
+		if (LuaExposableTraits<T>::userdata)
+			LuaObject::makeClass(L, -1);
+	}
+	
+	/** Declares the data member Member of the class a property of the class
+	 table on top of the stack. Scripts read and write the property like any
+	 other field of the instance, but the value lives in the C++ object only.
+	 Const members are read-only. Use the OBJLUA_PROPERTY macro in expose,
+	 after exposing the base functions.
+	 
+	 @code
+	 LuaExposable<Sprite>::expose(L);
+	 OBJLUA_PROPERTY(name, &Sprite::name);
+	 @endcode */
+	template <auto Member>
+	static void property(lua_State * L, const char * name)
+	{
+		LuaObject::addProperty(L, -1, name, &Field<Member>::accessors);
+	}
+	
+	/** Calls the member function Member on the object passed as self. The
+	 thunk is generated at compile time from the function's signature: it
+	 resolves self once, checks and converts the arguments through LuaValue,
+	 and pushes the return value if there is one. Use the OBJLUA_METHOD macro
+	 to register member functions as methods.
+	 
+	 @code
+	 static const luaL_Reg functions[] = {
+		 {"say", OBJLUA_METHOD(&Sprite::say)},
+		 {NULL, NULL}
+	 };
+	 @endcode */
+	template <auto Member>
+	static int lua_method(lua_State * L)
+	{
+		typedef Signature<decltype(Member)> S;
+		return invoke<Member>(L, (typename S::Arguments *)NULL,
+							  std::make_index_sequence<std::tuple_size<typename S::Arguments>::value>());
 	}
 	
 	/** Interprets the given stack item as an exposed object and tries to re-
 	 trieve the C++ object pointer it is associated with.
 	 
-	 @return Returns NULL if retrieval was unsuccessful. */
+	 @return Returns NULL if retrieval was unsuccessful, or if the object has
+			 already been deleted. */
 	static T * fromStack(lua_State * L, int index)
 	{
-		//Check whether the type matches.
-		luaL_checktype(L, index, LUA_TTABLE);
+		LuaObject::Data * data;
 		
-		//Extract the __this field which should contain the pointer.
-		lua_getfield(L, index, "__this");
+		//Userdata instances carry the pointer themselves.
+		if (lua_type(L, index) == LUA_TUSERDATA) {
+			data = LuaObject::toData(L, index);
+			if (!data) {
+				std::cerr << "objlua: *** Unable to retrieve C++ object from stack."
+				" Userdata is no exposed object.\n";
+				return NULL;
+			}
+		} else {
+			//Check whether the type matches.
+			luaL_checktype(L, index, LUA_TTABLE);
+			
+			//Extract the __this field which should contain the pointer.
+			lua_getfield(L, index, "__this");
+			
+			//Check whether the userdata is valid and extract the pointer.
+			if (!lua_isuserdata(L, -1)) {
+				lua_pop(L, 1);
+				std::cerr << "objlua: *** Unable to retrieve C++ object from stack."
+				" __this field does not contain userdata.\n";
+				return NULL;
+			}
+			data = (LuaObject::Data *)lua_touserdata(L, -1);
+			lua_pop(L, 1);
+			
+			//Capture the unlikely event touserdata returns NULL.
+			if (!data) {
+				std::cerr << "objlua: *** C++ object retrieved from stack is"
+				" NULL.\n";
+				return NULL;
+			}
+		}
 		
-		//Check whether the userdata is valid and extract the pointer.
-		if (!lua_isuserdata(L, -1)) {
+		//Instances of other exposed classes lead to objects of another type.
+		if (data->type != &typeTag) {
 			std::cerr << "objlua: *** Unable to retrieve C++ object from stack."
-			" __this field does not contain userdata.\n";
+			" Object is of another class.\n";
 			return NULL;
 		}
-		void * ptr = lua_touserdata(L, -1);
-		lua_pop(L, 1);
 		
-		//Capture the unlikely event touserdata returns NULL.
-		if (!ptr) {
-			std::cerr << "objlua: *** C++ object retrieved from stack is"
-			" NULL.\n";
+		//Objects that have been deleted leave their instance behind.
+		if (!data->object) {
+			std::cerr << "objlua: *** C++ object retrieved from stack has been"
+			" deleted.\n";
 			return NULL;
 		}
 		
 		//Return the pointer to the exposable.
-		return *((T **)ptr);
+		return (T *)data->object;
+	}
+	
+	/** Returns the object of the instance at the given index, or NULL if the
+	 value is no instance of this class or its object has been deleted. Unlike
+	 fromStack, this reports nothing. The class tag identifies the data of the
+	 instance by itself, so its metatable is not compared, which makes this as
+	 cheap as looking up __this by hand. */
+	static T * toObject(lua_State * L, int index)
+	{
+		if (index < 0)
+			index += lua_gettop(L) + 1;
+		void * p;
+		if (lua_type(L, index) == LUA_TTABLE) {
+			lua_pushliteral(L, "__this");
+			lua_rawget(L, index);
+			p = lua_touserdata(L, -1);
+			if (p && lua_objlen(L, -1) != sizeof(LuaObject::Data))
+				p = NULL;
+			lua_pop(L, 1);
+		} else {
+			p = lua_touserdata(L, index);
+			if (p && lua_objlen(L, index) != sizeof(LuaObject::Data))
+				p = NULL;
+		}
+		LuaObject::Data * data = (LuaObject::Data *)p;
+		return (data && data->type == &typeTag ? (T *)data->object : NULL);
+	}
+	
+	/** Allocates an object of the exposed class, taking it from the pool of
+	 the state L if the class is pooled.
+	 
+	 @code
+	 Sprite * sprite = new (L) Sprite(L);
+	 @endcode */
+	static void * operator new(size_t size, lua_State * L)
+	{
+		if (!LuaExposableTraits<T>::pooled)
+			return ::operator new(size);
+		return LuaObjectPool::allocate(pool(L), size);
+	}
+	static void * operator new(size_t size)
+	{
+		if (!LuaExposableTraits<T>::pooled)
+			return ::operator new(size);
+		return LuaObjectPool::allocate(NULL, size);
+	}
+	static void operator delete(void * object)
+	{
+		if (!LuaExposableTraits<T>::pooled)
+			::operator delete(object);
+		else
+			LuaObjectPool::deallocate(object);
+	}
+	static void operator delete(void * object, lua_State * L) { operator delete(object); }
+	
+	/** Placement forms, which the overloads above would hide otherwise. */
+	static void * operator new(size_t size, void * p) { return p; }
+	static void operator delete(void * object, void * p) {}
+	
+	/** Returns the pool the objects of a pooled class are allocated from in
+	 the state L, or NULL if there is none yet. */
+	static const LuaObjectPool * getPool(lua_State * L)
+	{
+		return LuaObjectPool::find(L, (void *)&pool);
 	}
 	
 	/** Creates a new LuaExposable instance. The instance is not automatically constructed in Lua,
 	 you have to do this manually by calling the constructLua function. */
-	LuaExposable(lua_State * L) : L(L) {}
+	LuaExposable(lua_State * L) : L(L), anchored(false), cls(NULL), data(NULL),
+		ownership(LuaExposableTraits<T>::ownership), retained(0) {}
 	
 	/** Gets rid of the LuaExposable instance. */
 	virtual ~LuaExposable()
 	{
-		//Remove the reference we hold to our instance.
-		luaL_unref(L, LUA_REGISTRYINDEX, ref);
-		ref = 0;
+		//Mark the instance as dead, so it no longer leads to this object, and
+		//drop it from the identity map.
+		if (data) {
+			data->object = NULL;
+			LuaObject::setInstance(L, this, 0);
+			if (anchored)
+				LuaObject::setAnchor(L, this, 0);
+			if (cls)
+				cls->instances--;
+		}
+		data = NULL;
+		anchored = false;
 	}
 	
 	/** Constructs the Lua representation of this object. This function effectively instantiates
@@ -84,28 +277,11 @@ public:
 		//Count the arguments supplied to the Lua function.
 		int argc = lua_gettop(L);
 		
-		//Create a new table which will act as the object instance.
-		lua_newtable(L);
-		
-		//Allocate memory for a pointer to the object.
-		LuaExposable ** s = (LuaExposable **)lua_newuserdata(L, sizeof(LuaExposable<T> *));
-		
-		//Now to some magic. We need the pointer to point at the entire class, not only at the
-		//LuaExposable portion. The following snippet of code shifts the this pointer appropriately.
-		//It is taken from the "Enginuity Part II" tutorial on gamedev.net.
-		long offset = (long)(T *)1 - (long)(LuaExposable<T> *)(T *)1;
-		*s = (LuaExposable<T> *)((long)this + offset);
-		
-		//Store the userdata under the __this index in the table.
-		lua_setfield(L, -2, "__this");
-		
-		//Load the global table for this class and assign it as metatable. This
-		//is either done by looking up the class table using the provided class
-		//name, or using the first argument of the Lua function call on the
-		//stack as table.
+		//Load the global table for this class. This is either done by looking
+		//up the class table using the provided class name, or using the first
+		//argument of the Lua function call on the stack as table.
 		if (!className) {
 			if (argc < 1 || lua_type(L, 1) != LUA_TTABLE) {
-				lua_pop(L, 1);
 				luaL_error(L, "Trying to construct a LuaExposable "
 						   "without a valid class table. Call Class:new() "
 						   "instead of Class.new().\n");
@@ -116,9 +292,12 @@ public:
 		} else {
 			lua_getglobal(L, className);
 		}
-		lua_getfield(L, -1, "__class");
-		lua_insert(L, -2);
-		lua_setmetatable(L, -3);
+		
+		//Create the instance and fetch the name of the class, which is also
+		//the name of the constructor.
+		instantiate(lua_gettop(L));
+		lua_getfield(L, -2, "__class");
+		lua_remove(L, -3);
 		
 		//Try to get a grip on the constructor for this class.
 		lua_gettable(L, -2);
@@ -141,27 +320,151 @@ public:
 			lua_pop(L, 1);
 		}
 		
-		//Fetch a reference to the object. If we're required to leave the
-		//initialized instance on the stack, we need to copy it so we may get
-		//a reference.
-		if (leaveOnStack)
-			lua_pushvalue(L, -1);
-		ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		//The instance is linked to this object already, so only leave it on the
+		//stack if required.
+		if (!leaveOnStack)
+			lua_pop(L, 1);
+	}
+	
+	/** Pushes this instance's table onto the Lua stack, looking it up in the
+	 identity map by the object's pointer. If the instance of an object owned
+	 by C++ has been collected, a new one is created and its constructor is
+	 run without arguments. Pushes nil if there is no instance. */
+	void loadReference()
+	{
+		LuaObject::pushInstance(L, this);
+		if (lua_isnil(L, -1) && cls && ownership == LUA_OWNED_BY_CPP) {
+			lua_pop(L, 1);
+			recreate();
+		}
 	}
 	
-	/** Pushes this instance's table onto the Lua stack. Calls loadReference(ref). */
-	void loadReference() { Lua::loadReference(L, ref); }
+	/** Returns the Lua state the object lives in. */
+	lua_State * getState() const { return L; }
+	
+	/** Returns the class the object was instantiated as in Lua, or NULL if it
+	 has no instance or its class was not created through LuaClass::make. */
+	LuaClassInfo * getClass() const { return cls; }
+	
+	/** Returns which side controls the lifetime of this object. */
+	LuaOwnership getOwnership() const { return ownership; }
+	
+	/** Changes which side controls the lifetime of this object. */
+	void setOwnership(LuaOwnership o)
+	{
+		loadReference();
+		ownership = o;
+		if (!lua_isnil(L, -1))
+			link();
+		lua_pop(L, 1);
+	}
+	
+	/** Keeps a shared object alive until the matching call to release. */
+	void retain()
+	{
+		if (retained++ == 0 && ownership == LUA_SHARED) {
+			loadReference();
+			if (!lua_isnil(L, -1))
+				link();
+			lua_pop(L, 1);
+		}
+	}
+	
+	/** Releases a shared object. It is deleted once the C++ side released it
+	 and its Lua instance is collected. */
+	void release()
+	{
+		assert(retained > 0);
+		if (--retained == 0 && ownership == LUA_SHARED) {
+			loadReference();
+			if (!lua_isnil(L, -1))
+				link();
+			lua_pop(L, 1);
+		}
+	}
 	
 	/** Pushes the given function and this instance onto the Lua stack, so the
 	 function may be called. */
 	bool loadFunction(const char * fn)
 	{
-		return Lua::loadFunction(L, fn, ref);
+		loadReference();
+		return Lua::loadMethod(L, fn);
+	}
+	
+	/** Same as loadFunction, but returns false right away if the class of
+	 this object is known not to implement the hook. */
+	bool loadFunction(const LuaHook & hook)
+	{
+		if (lacks(hook))
+			return false;
+		return loadFunction(hook.name);
+	}
+	
+	/** Returns whether the class of this object implements the hook. The
+	 answer is cached per class, see LuaClass::implements. */
+	bool implements(const LuaHook & hook)
+	{
+		if (cls)
+			return LuaClass::implements(L, cls, hook);
+		if (!loadFunction(hook.name))
+			return false;
+		lua_pop(L, 2);
+		return true;
+	}
+	
+	/** Calls the Lua function with the given name on this instance. The
+	 arguments are pushed according to their C++ types, which may be numbers,
+	 booleans, strings and pointers to other exposed objects. The call expects
+	 the return types R... and yields a bool indicating success if there are
+	 none, an optional value for a single return type and an optional tuple for
+	 several. Calls to functions the instance does not implement fail silently.
+	 
+	 @code
+	 sprite->call("animate", 1.0, "x", other);
+	 std::optional<std::tuple<double, std::string> > r =
+		 sprite->call<double, std::string>("describe");
+	 @endcode */
+	template <typename... R, typename... Args>
+	typename LuaReturn<R...>::type call(const char * fn, Args &&... args)
+	{
+		loadReference();
+		return Lua::invokeMethod<R...>(L, fn, false, std::forward<Args>(args)...);
+	}
+	
+	/** Calls the method behind the given handle on this instance. This avoids
+	 looking up the method by name on every call. Arguments and return values
+	 are handled as for the call function above. */
+	template <typename... R, typename... Args>
+	typename LuaReturn<R...>::type call(LuaMethod & method, Args &&... args)
+	{
+		if (!cls) {
+			loadReference();
+			return Lua::invokeMethod<R...>(L, method.getName(), false,
+										   std::forward<Args>(args)...);
+		}
+		
+		int errfunc;
+		if (!method.load(cls, errfunc))
+			return LuaReturn<R...>::failure();
+		loadReference();
+		return Lua::callPrepared<R...>(L, method.getName(), errfunc, std::forward<Args>(args)...);
+	}
+	
+	/** Calls the hook on this instance, unless its class is known not to im-
+	 plement it, in which case the call fails without touching Lua. Arguments
+	 and return values are handled as for the call function above. */
+	template <typename... R, typename... Args>
+	typename LuaReturn<R...>::type call(const LuaHook & hook, Args &&... args)
+	{
+		if (lacks(hook))
+			return LuaReturn<R...>::failure();
+		return call<R...>(hook.name, std::forward<Args>(args)...);
 	}
 	
 	/** Calls the Lua function with the given name. Each character in the format string specifies
 	 the type of an argument to be passed to the function. The results field indicates how many re-
-	 turn values are to be expected of the call.
+	 turn values are to be expected of the call. Prefer call, which checks the argument types at
+	 compile time.
 	 
 	 The following are the accepted argument types:
 	 n  number (double)
@@ -171,71 +474,51 @@ public:
 	bool callFunction(const char * fn, const char * format = "", int results = 0, ...)
 	{
 		assert(fn && format);
-		
-		//Load the stacktrace.
-		lua_getglobal(L, "stacktrace");
-		int trace = lua_gettop(L);
-		
-		//Load the requested function.
-		if (!loadFunction(fn)) {
-			/*LuaState::stacktrace(L);
-			LuaError::report(L);*/
-			lua_remove(L, trace);
+		int trace;
+		loadReference();
+		if (!Lua::callMethodProlog(L, fn, trace, false))
 			return false;
-		}
 		
-		//Fetch the argument list.
+		//Push the arguments according to the format specification.
 		va_list args;
 		va_start(args, results);
-		
-		//Iterate through the format and push the argument to the Lua stack, depending on the format
-		//specification.
-		int argc = 0;
-		for (const char * ptr = format; *ptr != 0; ptr++) {
-			switch (*ptr) {
-				case 'n':	lua_pushnumber(L, va_arg(args, double)); break;
-				case 's':	lua_pushstring(L, va_arg(args, const char *)); break;
-				case 'o':	va_arg(args, LuaExposable *)->loadReference(); break;
-				default: {
-					std::cerr << "objlua: *** Format error in call to function ";
-					std::cerr << fn << ", type " << *ptr << " unknown\n";
-					return false;
-				} break;
-			}
-			argc++;
-		}
-		
-		//Call the function.
-		if (lua_pcall(L, argc + 1, results, trace) != 0) {
-			LuaError::report(L);
-			lua_remove(L, trace);
+		int argc = Lua::pushFormatted(L, fn, format, args, pushObject);
+		va_end(args);
+		if (argc < 0) {
+			lua_settop(L, trace - 1);
 			return false;
 		}
 		
-		//Get rid of the stacktrace global.
-		lua_pop(L, 1);
-		
-		//We're done.
-		va_end(args);
-		return true;
+		return Lua::callFunctionEpilog(L, fn, LUA_NOREF, trace, argc, results);
 	}
 	
 protected:
 	/** Reference to the Lua state the instance of this object lives in. */
 	lua_State * L;
-	/** Reference to the Lua instance of this object. */
-	int ref;
+	/** Whether the instance is kept alive by an anchor, rather than only
+	 being referenced weakly by the identity map. */
+	bool anchored;
+	/** Information about the class this object was instantiated as in Lua. */
+	LuaClassInfo * cls;
+	/** The userdata leading from the Lua instance to this object, or NULL if
+	 the instance has been collected. */
+	LuaObject::Data * data;
+	/** Which side controls the lifetime of this object. */
+	LuaOwnership ownership;
+	/** Number of retain calls not yet matched by a release. */
+	int retained;
 	
 protected:
 	/** Instantiates a new instance of the given class. */
 	static int lua_new(lua_State * L)
 	{
-		T * instance = new T(L);
+		T * instance = new (L) T(L);
 		instance->constructLua(NULL);
 		return 1;
 	}
 	
-	/** Deletes the object. */
+	/** Deletes the object. Its instance remains in Lua, but no longer leads to
+	 the object. */
 	static int lua_delete(lua_State * L)
 	{
 		//Get the pointer to the object.
@@ -247,6 +530,226 @@ protected:
 		delete obj;
 		return 0;
 	}
+	
+private:
+	/** Class, return type and argument types of a member function of T or one
+	 of its base classes. */
+	template <typename M> struct Signature;
+	template <typename C, typename R, typename... A> struct Signature<R (C::*)(A...)> {
+		typedef C Class;
+		typedef R Result;
+		typedef std::tuple<A...> Arguments;
+	};
+	template <typename C, typename R, typename... A>
+	struct Signature<R (C::*)(A...) const> : Signature<R (C::*)(A...)> {};
+	template <typename C, typename R, typename... A>
+	struct Signature<R (C::*)(A...) noexcept> : Signature<R (C::*)(A...)> {};
+	template <typename C, typename R, typename... A>
+	struct Signature<R (C::*)(A...) const noexcept> : Signature<R (C::*)(A...)> {};
+	
+	/** Body of lua_method. Arguments are converted and checked in one go, un-
+	 less one of them converts to an object with a destructor, e.g. a string.
+	 In that case all arguments are checked before any of them is converted,
+	 since an error raised by a check would skip the destructor. */
+	template <auto Member, typename... A, size_t... I>
+	static int invoke(lua_State * L, std::tuple<A...> *, std::index_sequence<I...>)
+	{
+		typedef Signature<decltype(Member)> S;
+		typename S::Class * object = self(L);
+		constexpr bool trivial = (std::is_trivially_destructible<typename std::decay<A>::type>::value && ...);
+		if constexpr (!trivial)
+			(check<A>(L, (int)I + 2), ...);
+		if constexpr (std::is_void<typename S::Result>::value) {
+			(object->*Member)(argument<A, trivial>(L, (int)I + 2)...);
+			return 0;
+		} else {
+			LuaValue<typename std::decay<typename S::Result>::type>::push(L,
+				(object->*Member)(argument<A, trivial>(L, (int)I + 2)...));
+			return 1;
+		}
+	}
+	
+	/** Checks the argument at the given index without keeping the converted
+	 value around. Strings are checked without being copied. */
+	template <typename A>
+	static void check(lua_State * L, int index)
+	{
+		typedef typename std::decay<A>::type Type;
+		if constexpr (std::is_same<Type, std::string>::value)
+			luaL_checkstring(L, index);
+		else
+			LuaValue<Type>::check(L, index);
+	}
+	
+	/** Converts the argument at the given index, checking it as well unless
+	 that has been done up front. */
+	template <typename A, bool checking>
+	static typename std::decay<A>::type argument(lua_State * L, int index)
+	{
+		if constexpr (checking)
+			return LuaValue<typename std::decay<A>::type>::check(L, index);
+		else
+			return LuaValue<typename std::decay<A>::type>::get(L, index);
+	}
+	
+	/** Returns the object passed as self to a method, raising an error if
+	 there is none. */
+	static T * self(lua_State * L)
+	{
+		T * object = toObject(L, 1);
+		if (!object)
+			luaL_error(L, "Method called without a valid object. Call obj:method() "
+					   "instead of obj.method().");
+		return object;
+	}
+	
+	/** Accessors of the property backed by the data member Member of T or one
+	 of its base classes. */
+	template <auto Member> struct Field {
+		template <typename P> struct Pointer;
+		template <typename C, typename F> struct Pointer<F C::*> {
+			typedef C Class;
+			typedef typename std::remove_cv<F>::type Type;
+			static const bool writable = !std::is_const<F>::value;
+		};
+		typedef Pointer<decltype(Member)> P;
+		
+		static void get(lua_State * L, void * object)
+		{
+			typename P::Class * o = static_cast<T *>(object);
+			LuaValue<typename P::Type>::push(L, o->*Member);
+		}
+		static void set(lua_State * L, void * object, int index)
+		{
+			if constexpr (P::writable) {
+				typename P::Class * o = static_cast<T *>(object);
+				o->*Member = LuaValue<typename P::Type>::check(L, index);
+			}
+		}
+		static inline const LuaObject::Property accessors = {get, P::writable ? set : NULL};
+	};
+	
+	/** Identifies the objects of T in their instances' data. */
+	static inline const char typeTag = 0;
+	
+	/** Returns the pool of the class in the state L, creating it if required. */
+	static LuaObjectPool * pool(lua_State * L)
+	{
+		return LuaObjectPool::get(L, (void *)&pool, sizeof(T), destroy);
+	}
+	
+	/** Deletes an object still alive when its pool is torn down. */
+	static void destroy(void * object) { delete (T *)object; }
+	
+	/** Pushes a new instance of the class table at the given index and links it
+	 to this object. Does not run the constructor. */
+	void instantiate(int classIndex)
+	{
+		if (!lua_istable(L, classIndex))
+			luaL_error(L, "Trying to construct a LuaExposable without a valid "
+					   "class table.");
+		bool previous = (data != NULL);
+		
+		if (LuaExposableTraits<T>::userdata) {
+			//Create a single userdata which will act as the object instance.
+			data = LuaObject::create(L, static_cast<T *>(this), finalize, &typeTag);
+			LuaObject::bind(L, -1, classIndex);
+		} else {
+			//Create a new table which will act as the object instance, and a
+			//userdata pointing to the object under its __this index. The
+			//userdata notifies the object when the instance is collected.
+			lua_newtable(L);
+			data = LuaObject::create(L, static_cast<T *>(this), finalize, &typeTag);
+			LuaObject::attachFinalizer(L, -1);
+			lua_setfield(L, -2, "__this");
+		}
+		
+		//Make the class table the instance's metatable, and count the object
+		//towards its class instead of the class of a former instance.
+		if (previous && cls)
+			cls->instances--;
+		cls = LuaClass::info(L, classIndex);
+		if (cls)
+			cls->instances++;
+		lua_pushvalue(L, classIndex);
+		lua_setmetatable(L, -2);
+		
+		//Link the new instance, replacing any former one.
+		link();
+	}
+	
+	/** Pushes the instance of the exposed object passed to callFunction. */
+	static void pushObject(lua_State * L, void * object)
+	{
+		((LuaExposable *)object)->loadReference();
+	}
+	
+	/** Returns whether the class of this object is known not to implement the
+	 hook, counting the call as missing if so. */
+	bool lacks(const LuaHook & hook)
+	{
+		if (!cls || LuaClass::implements(L, cls, hook))
+			return false;
+#ifdef OBJLUA_METRICS
+		lua_rawgeti(L, LUA_REGISTRYINDEX, cls->ref);
+		LuaMetrics::missing(L, -1, hook.name);
+		lua_pop(L, 1);
+#endif
+		return true;
+	}
+	
+	/** Replaces the collected instance of an object owned by C++ by a new one,
+	 runs its constructor and pushes it. */
+	void recreate()
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, cls->ref);
+		instantiate(lua_gettop(L));
+		lua_remove(L, -2);
+		
+		lua_getfield(L, -1, "__class");
+		lua_gettable(L, -2);
+		if (lua_isfunction(L, -1)) {
+			lua_pushvalue(L, -2);
+			if (lua_pcall(L, 1, 0, 0) != 0) {
+				LuaState::stacktrace(L);
+				LuaError::report(L);
+			}
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+	
+	/** Enters the instance on top of the stack into the identity map and
+	 anchors it if this object keeps it alive, depending on the ownership. */
+	void link()
+	{
+		bool strong = (ownership == LUA_PINNED || (ownership == LUA_SHARED && retained > 0));
+		LuaObject::setInstance(L, this, -1);
+		if (strong || anchored)
+			LuaObject::setAnchor(L, this, (strong ? -1 : 0));
+		anchored = strong;
+	}
+	
+	/** Called when the userdata leading to the object is collected. Deletes the
+	 object if the Lua side owns it. */
+	static void finalize(void * object, LuaObject::Data * d)
+	{
+		LuaExposable<T> * self = (T *)object;
+		if (self->data != d)
+			return;
+		
+		//The instance is gone. If it was anchored, the state is being closed
+		//and the anchor is gone as well.
+		self->data = NULL;
+		self->anchored = false;
+		if (self->cls)
+			self->cls->instances--;
+		if (self->ownership == LUA_OWNED_BY_LUA ||
+			(self->ownership == LUA_SHARED && self->retained == 0))
+			delete (T *)object;
+	}
 };
 
 #define OBJLUA_CONSTRUCTOR(cls) cls(lua_State *L) : LuaExposable<cls>(L)
+#define OBJLUA_PROPERTY(name, member) property<member>(L, #name)
+#define OBJLUA_METHOD(member) lua_method<member>
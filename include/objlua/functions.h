@@ -1,7 +1,13 @@
 #pragma once
 #include <cassert>
 #include <cstdarg>
+#include <iostream>
+#include <utility>
+#include "error.h"
 #include "lua.h"
+#include "metrics.h"
+#include "state.h"
+#include "value.h"
 
 class Lua
 {
@@ -16,14 +22,24 @@ public:
 	 function may be called. */
 	static bool loadFunction(lua_State * L, const char * fn, int ref)
 	{
-		assert(fn);
-		
 		//Resolve the reference and move it onto the stack.
 		loadReference(L, ref);
+		return loadMethod(L, fn);
+	}
+	
+	/** Same as loadFunction, but for the instance on top of the stack. Leaves
+	 the function followed by the instance on the stack, or pops the instance
+	 and returns false if there is no such function. */
+	static bool loadMethod(lua_State * L, const char * fn)
+	{
+		assert(fn);
 		
 		//Get the requested function.
 		lua_getfield(L, -1, fn);
 		if (!lua_isfunction(L, -1)) {
+#ifdef OBJLUA_METRICS
+			LuaMetrics::missing(L, -2, fn);
+#endif
 			lua_pop(L, 2);
 			//lua_pushfstring(L, "Unable to load unknown function \"%s\"", fn);
 			return false;
@@ -35,18 +51,32 @@ public:
 		return true;
 	}
 	
-	static bool callFunctionProlog(lua_State * L, const char * fn, int ref, int & trace)
+	/** Loads the stacktrace error handler followed by the given function and
+	 the instance pointed to by ref. The stack index of the error handler is
+	 stored in trace. If the function does not exist, nothing is left on the
+	 stack and the failure is reported unless reportMissing is false. */
+	static bool callFunctionProlog(lua_State * L, const char * fn, int ref, int & trace,
+								   bool reportMissing = true)
+	{
+		loadReference(L, ref);
+		return callMethodProlog(L, fn, trace, reportMissing);
+	}
+	
+	/** Same as callFunctionProlog, but for the instance on top of the stack. */
+	static bool callMethodProlog(lua_State * L, const char * fn, int & trace,
+								 bool reportMissing = true)
 	{
 		assert(fn);
 		
-		//Load the stacktrace.
+		//Load the stacktrace below the instance.
 		lua_getglobal(L, "stacktrace");
-		trace = lua_gettop(L);
+		lua_insert(L, -2);
+		trace = lua_gettop(L) - 1;
 		
 		//Load the requested function.
-		if (!loadFunction(L, fn, ref)) {
-			LuaState::stacktrace(L);
-			LuaError::report(L);
+		if (!loadMethod(L, fn)) {
+			if (reportMissing)
+				std::cerr << "objlua: *** Unable to call unknown function " << fn << "\n";
 			lua_remove(L, trace);
 			return false;
 		}
@@ -54,10 +84,22 @@ public:
 		return true;
 	}
 	
+	/** Calls the method which was loaded together with its instance and argc
+	 arguments, like lua_pcall. The call is counted by LuaMetrics if the
+	 library is compiled with OBJLUA_METRICS, and made directly otherwise. */
+	static int pcall(lua_State * L, const char * fn, int argc, int results, int errfunc)
+	{
+#ifdef OBJLUA_METRICS
+		return LuaMetrics::pcall(L, fn, argc, results, errfunc);
+#else
+		return lua_pcall(L, argc + 1, results, errfunc);
+#endif
+	}
+	
 	static bool callFunctionEpilog(lua_State * L, const char * fn, int ref, int trace, int argc, int results = 0)
 	{
 		//Call the function.
-		if (lua_pcall(L, argc + 1, results, trace) != 0) {
+		if (pcall(L, fn, argc, results, trace) != 0) {
 			LuaError::report(L);
 			lua_remove(L, trace);
 			return false;
@@ -70,6 +112,73 @@ public:
 		return true;
 	}
 	
+	/** Calls the Lua function with the given name on the instance pointed to
+	 by ref. The arguments are pushed according to their C++ types, and the call
+	 expects the return types R... The result is a bool indicating success if no
+	 return types are given, an optional value for a single return type, and an
+	 optional tuple for several return types.
+	 
+	 @code
+	 Lua::call(L, "animate", ref, 1.0, "x", other);
+	 std::optional<int> n = Lua::call<int>(L, "count", ref);
+	 @endcode */
+	template <typename... R, typename... Args>
+	static typename LuaReturn<R...>::type call(lua_State * L, const char * fn, int ref,
+											   Args &&... args)
+	{
+		return invoke<R...>(L, fn, ref, true, std::forward<Args>(args)...);
+	}
+	
+	/** Same as call, but lets the caller decide whether a missing function is
+	 reported as an error or silently treated as a failed call. */
+	template <typename... R, typename... Args>
+	static typename LuaReturn<R...>::type invoke(lua_State * L, const char * fn, int ref,
+												 bool reportMissing, Args &&... args)
+	{
+		loadReference(L, ref);
+		return invokeMethod<R...>(L, fn, reportMissing, std::forward<Args>(args)...);
+	}
+	
+	/** Same as invoke, but calls the function on the instance on top of the
+	 stack. The instance is consumed. */
+	template <typename... R, typename... Args>
+	static typename LuaReturn<R...>::type invokeMethod(lua_State * L, const char * fn,
+													   bool reportMissing, Args &&... args)
+	{
+		int trace;
+		if (!callMethodProlog(L, fn, trace, reportMissing))
+			return LuaReturn<R...>::failure();
+		return callPrepared<R...>(L, fn, trace, std::forward<Args>(args)...);
+	}
+	
+	/** Pushes the arguments and calls the function fn that was loaded together
+	 with its instance on top of the error handler at index trace. Leaves the
+	 stack as it was before the error handler was pushed. */
+	template <typename... R, typename... Args>
+	static typename LuaReturn<R...>::type callPrepared(lua_State * L, const char * fn, int trace,
+													   Args &&... args)
+	{
+		//Push the arguments. The push functions are chosen at compile time.
+		(LuaValue<typename std::decay<Args>::type>::push(L, args), ...);
+		
+		//Call the function.
+		const int results = (int)sizeof...(R);
+		if (pcall(L, fn, (int)sizeof...(Args), results, trace) != 0) {
+			LuaError::report(L);
+			lua_remove(L, trace);
+			return LuaReturn<R...>::failure();
+		}
+		
+		//Fetch the results and get rid of them and the stacktrace global.
+		typename LuaReturn<R...>::type result = LuaReturn<R...>::pull(L, trace + 1);
+		lua_settop(L, trace - 1);
+		return result;
+	}
+	
+	/** Format string variant of call. Each character in the format string
+	 specifies the type of an argument: n for numbers (double), s for C strings
+	 and o for registry references (int). Prefer call, which checks the argument
+	 types at compile time. */
 	static bool callFunction(lua_State * L, const char * fn, int ref, int results = 0, const char * format = "", ...)
 	{
 		assert(fn && format);
@@ -79,26 +188,44 @@ public:
 			return false;
 		}
 		
-		//Iterate through the format and push the argument to the Lua stack, depending on the format
-		//specification.
 		va_list args;
 		va_start(args, format);
+		int argc = pushFormatted(L, fn, format, args);
+		va_end(args);
+		if (argc < 0) {
+			lua_settop(L, trace - 1);
+			return false;
+		}
+		
+		return callFunctionEpilog(L, fn, ref, trace, argc, results);
+	}
+	
+	/** Pushes the arguments described by the given format string. Objects ('o')
+	 are passed as registry references, or as pointers pushed by pushObject if
+	 it is given. Returns the number of arguments pushed, or -1 if the format
+	 string contains an unknown type. */
+	static int pushFormatted(lua_State * L, const char * fn, const char * format, va_list args,
+							 void (*pushObject)(lua_State * L, void * object) = NULL)
+	{
 		int argc = 0;
 		for (const char * ptr = format; *ptr != 0; ptr++) {
 			switch (*ptr) {
-				case 'n':	lua_pushnumber(L, va_arg(args, double)); break;
-				case 's':	lua_pushstring(L, va_arg(args, const char *)); break;
-				case 'o':	loadReference(L, va_arg(args, int)); break;
+				case 'n':	LuaValue<double>::push(L, va_arg(args, double)); break;
+				case 's':	LuaValue<const char *>::push(L, va_arg(args, const char *)); break;
+				case 'o':
+					if (pushObject)
+						pushObject(L, va_arg(args, void *));
+					else
+						loadReference(L, va_arg(args, int));
+					break;
 				default: {
 					std::cerr << "objlua: *** Format error in call to function ";
 					std::cerr << fn << ", type " << *ptr << " unknown\n";
-					return false;
+					return -1;
 				} break;
 			}
 			argc++;
 		}
-		va_end(args);
-		
-		return callFunctionEpilog(L, fn, ref, trace, argc, results);
+		return argc;
 	}
 };
@@ -0,0 +1,163 @@
+#pragma once
+#include <cassert>
+#include <string>
+#include <utility>
+#include "class.h"
+#include "functions.h"
+#include "lua.h"
+#include "value.h"
+
+
+/** Handle to a Lua method that is called repeatedly from C++, e.g. a hook that
+ is invoked on many objects every frame. The handle resolves the method once
+ per class and keeps the resolved function in the registry, together with the
+ stacktrace error handler which is pinned when the handle is created. Calling
+ through the handle thus costs a few lua_rawgeti calls and the lua_pcall, with-
+ out any string lookups.
+ 
+ Resolutions are cached for a small number of classes and are dropped as soon
+ as the version of the class changes, i.e. whenever the class table or one of
+ its superclasses is assigned to. Note that the method is resolved through the
+ class, so functions stored in an individual instance are not seen.
+ 
+ The handle must not outlive the Lua state it was created for. */
+class LuaMethod {
+public:
+	/** Creates a handle for the method with the given name. */
+	LuaMethod(lua_State * L, const char * name) : L(L), name(name), next(0)
+	{
+		assert(name);
+		lua_getglobal(L, "stacktrace");
+		trace = luaL_ref(L, LUA_REGISTRYINDEX);
+		for (int i = 0; i < CACHE_SIZE; i++) {
+			cache[i].cls = NULL;
+			cache[i].version = 0;
+			cache[i].fn = LUA_NOREF;
+		}
+	}
+	
+	/** Releases the registry references held by the handle. */
+	~LuaMethod()
+	{
+		luaL_unref(L, LUA_REGISTRYINDEX, trace);
+		for (int i = 0; i < CACHE_SIZE; i++)
+			luaL_unref(L, LUA_REGISTRYINDEX, cache[i].fn);
+	}
+	
+	/** Returns the name of the method. */
+	const char * getName() const { return name.c_str(); }
+	
+	/** Returns the Lua state the handle was created for. */
+	lua_State * getState() const { return L; }
+	
+	/** Pushes the error handler onto the stack. */
+	void pushHandler() { lua_rawgeti(L, LUA_REGISTRYINDEX, trace); }
+	
+	/** Pushes the method as implemented by the given class onto the stack.
+	 Returns false and leaves the stack untouched if the class does not im-
+	 plement the method. */
+	bool push(LuaClassInfo * cls)
+	{
+		assert(cls);
+		Entry * entry = resolve(cls);
+		if (entry->fn == LUA_REFNIL)
+			return false;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, entry->fn);
+		return true;
+	}
+	
+	/** Pushes the error handler and the method as implemented by the given
+	 class onto the stack. The caller is expected to push the instance next.
+	 The stack index of the error handler is stored in errfunc. Returns false
+	 and leaves the stack untouched if the class does not implement the
+	 method. */
+	bool load(LuaClassInfo * cls, int & errfunc)
+	{
+		pushHandler();
+		if (!push(cls)) {
+			lua_pop(L, 1);
+#ifdef OBJLUA_METRICS
+			lua_rawgeti(L, LUA_REGISTRYINDEX, cls->ref);
+			LuaMetrics::missing(L, -1, name.c_str());
+			lua_pop(L, 1);
+#endif
+			return false;
+		}
+		errfunc = lua_gettop(L) - 1;
+		return true;
+	}
+	
+	/** Calls the method on the instance pointed to by ref, which is an instance
+	 of the given class. Arguments and return values are handled as in Lua::call.
+	 Calls to classes that do not implement the method fail silently. Instances
+	 of tables that are no proper classes fall back to a regular lookup. */
+	template <typename... R, typename... Args>
+	typename LuaReturn<R...>::type call(LuaClassInfo * cls, int ref, Args &&... args)
+	{
+		if (!cls)
+			return Lua::invoke<R...>(L, name.c_str(), ref, false, std::forward<Args>(args)...);
+		
+		int errfunc;
+		if (!load(cls, errfunc))
+			return LuaReturn<R...>::failure();
+		Lua::loadReference(L, ref);
+		return Lua::callPrepared<R...>(L, name.c_str(), errfunc, std::forward<Args>(args)...);
+	}
+	
+private:
+	LuaMethod(const LuaMethod &);
+	LuaMethod & operator=(const LuaMethod &);
+	
+	/** Number of classes the resolution is cached for. */
+	static const int CACHE_SIZE = 4;
+	
+	/** A cached resolution. fn is LUA_REFNIL if the class does not implement
+	 the method. */
+	struct Entry {
+		LuaClassInfo * cls;
+		unsigned version;
+		int fn;
+	};
+	
+	lua_State * L;
+	std::string name;
+	/** Registry reference to the pinned error handler. */
+	int trace;
+	Entry cache[CACHE_SIZE];
+	/** Next cache entry to be replaced. */
+	int next;
+	
+	/** Returns the cache entry for the given class, resolving the method again
+	 if there is none or the class has changed in the meantime. */
+	Entry * resolve(LuaClassInfo * cls)
+	{
+		Entry * entry = NULL;
+		for (int i = 0; i < CACHE_SIZE && !entry; i++)
+			if (cache[i].cls == cls)
+				entry = &cache[i];
+		if (entry && entry->version == cls->version)
+			return entry;
+		
+		//Pick an entry to replace if the class isn't in the cache yet.
+		if (!entry) {
+			entry = &cache[next];
+			next = (next + 1) % CACHE_SIZE;
+		}
+		
+		//Look up the method in the class table.
+		luaL_unref(L, LUA_REGISTRYINDEX, entry->fn);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, cls->ref);
+		lua_getfield(L, -1, name.c_str());
+		if (lua_isfunction(L, -1)) {
+			entry->fn = luaL_ref(L, LUA_REGISTRYINDEX);
+		} else {
+			lua_pop(L, 1);
+			entry->fn = LUA_REFNIL;
+		}
+		lua_pop(L, 1);
+		
+		entry->cls = cls;
+		entry->version = cls->version;
+		return entry;
+	}
+};
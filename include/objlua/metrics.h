@@ -0,0 +1,327 @@
+#pragma once
+#ifdef OBJLUA_METRICS
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "lua.h"
+
+
+/** Counters of the calls from C++ into Lua methods, kept per class and method
+ name. Only available if the library is compiled with OBJLUA_METRICS defined;
+ otherwise the calls are made directly and this class does not exist.
+ 
+ Every thread counts into counters of its own, which only it writes to, so
+ counting takes no locks. A snapshot sums up the counters of all threads while
+ they keep running. Counters of threads that have finished are kept.
+ 
+ @code
+ for (const LuaMetrics::Entry & e : LuaMetrics::snapshot())
+	 std::cout << e.name << ": " << e.calls << " calls, 99% within "
+			   << e.percentile(0.99) << " ns\n";
+ @endcode
+ In Lua, metrics() returns a table of the same entries by name. */
+class LuaMetrics {
+public:
+	/** Number of latency buckets. Bucket i counts the calls that took from
+	 2^i up to 2^(i+1) nanoseconds; the last one counts all longer calls. */
+	static const int BUCKETS = 40;
+	
+	/** Counters of a single method as seen by a snapshot. */
+	struct Entry {
+		/** Class and method name, e.g. Sprite:animate. */
+		std::string name;
+		/** Calls made, including failed ones. */
+		uint64_t calls;
+		/** Calls that raised an error. */
+		uint64_t failures;
+		/** Calls to instances that do not implement the method. */
+		uint64_t missing;
+		/** Time spent in the calls. */
+		uint64_t nanoseconds;
+		/** Latency histogram of the calls. */
+		uint64_t buckets[BUCKETS];
+		
+		/** Returns the latency in nanoseconds which the given fraction of the
+		 calls did not exceed, rounded up to the bucket's bound. */
+		uint64_t percentile(double fraction) const
+		{
+			uint64_t count = 0, threshold = (uint64_t)(fraction * calls);
+			for (int i = 0; i < BUCKETS; i++) {
+				count += buckets[i];
+				if (count && count >= threshold)
+					return (uint64_t)2 << i;
+			}
+			return 0;
+		}
+	};
+	
+	/** Returns the counters summed up across all threads, sorted by name. */
+	static std::vector<Entry> snapshot()
+	{
+		std::unordered_map<std::string, Entry> sums;
+		Registry & r = registry();
+		{
+			std::lock_guard<std::mutex> lock(r.mutex);
+			for (size_t i = 0; i < r.threads.size(); i++)
+				for (Table::iterator it = r.threads[i]->begin(); it != r.threads[i]->end(); ++it)
+					it->second->addTo(sums, it->first);
+			for (Table::iterator it = r.retired.begin(); it != r.retired.end(); ++it)
+				it->second->addTo(sums, it->first);
+		}
+		std::vector<Entry> entries;
+		entries.reserve(sums.size());
+		for (std::unordered_map<std::string, Entry>::iterator it = sums.begin(); it != sums.end(); ++it)
+			entries.push_back(it->second);
+		std::sort(entries.begin(), entries.end(), byName);
+		return entries;
+	}
+	
+	/** Writes a table of the counters to the given stream. */
+	static void write(std::ostream & out)
+	{
+		std::vector<Entry> entries = snapshot();
+		char line[128];
+		snprintf(line, sizeof(line), "%10s %8s %8s %10s %10s %10s  ",
+				 "calls", "failed", "missing", "mean ns", "p50 ns", "p99 ns");
+		out << line << "method\n";
+		for (size_t i = 0; i < entries.size(); i++) {
+			const Entry & e = entries[i];
+			snprintf(line, sizeof(line), "%10llu %8llu %8llu %10llu %10llu %10llu  ",
+					 (unsigned long long)e.calls, (unsigned long long)e.failures,
+					 (unsigned long long)e.missing,
+					 (unsigned long long)(e.calls ? e.nanoseconds / e.calls : 0),
+					 (unsigned long long)e.percentile(0.5), (unsigned long long)e.percentile(0.99));
+			out << line << e.name << "\n";
+		}
+	}
+	
+	/** Calls the method which was loaded together with its instance and argc
+	 arguments, like lua_pcall, and counts the call. */
+	static int pcall(lua_State * L, const char * fn, int argc, int results, int errfunc)
+	{
+		Counters * c = find(L, -(argc + 1), fn);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		int error = lua_pcall(L, argc + 1, results, errfunc);
+		uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count();
+		increment(c->calls);
+		if (error)
+			increment(c->failures);
+		increment(c->nanoseconds, ns);
+		increment(c->buckets[bucket(ns)]);
+		return error;
+	}
+	
+	/** Counts a call of a method which the instance or class at the given
+	 index does not implement. */
+	static void missing(lua_State * L, int index, const char * fn)
+	{
+		increment(find(L, index, fn)->missing);
+	}
+	
+	/** Function exposed to Lua as metrics() which returns a table of the
+	 entries of a snapshot by name. Each entry holds the counts, the mean and
+	 percentile latencies in nanoseconds and the histogram. */
+	static int lua_metrics(lua_State * L)
+	{
+		std::vector<Entry> entries = snapshot();
+		lua_createtable(L, 0, (int)entries.size());
+		for (size_t i = 0; i < entries.size(); i++) {
+			const Entry & e = entries[i];
+			lua_createtable(L, 0, 8);
+			setNumber(L, "calls", e.calls);
+			setNumber(L, "failures", e.failures);
+			setNumber(L, "missing", e.missing);
+			setNumber(L, "mean", e.calls ? e.nanoseconds / e.calls : 0);
+			setNumber(L, "p50", e.percentile(0.5));
+			setNumber(L, "p90", e.percentile(0.9));
+			setNumber(L, "p99", e.percentile(0.99));
+			lua_createtable(L, BUCKETS, 0);
+			for (int b = 0; b < BUCKETS; b++) {
+				lua_pushnumber(L, (lua_Number)e.buckets[b]);
+				lua_rawseti(L, -2, b + 1);
+			}
+			lua_setfield(L, -2, "buckets");
+			lua_setfield(L, -2, e.name.c_str());
+		}
+		return 1;
+	}
+	
+private:
+	/** Counters of a single method in a single thread. Only the owning thread
+	 writes to them. */
+	struct Counters {
+		std::atomic<uint64_t> calls;
+		std::atomic<uint64_t> failures;
+		std::atomic<uint64_t> missing;
+		std::atomic<uint64_t> nanoseconds;
+		std::atomic<uint64_t> buckets[BUCKETS];
+		
+		Counters() : calls(0), failures(0), missing(0), nanoseconds(0)
+		{
+			for (int i = 0; i < BUCKETS; i++)
+				buckets[i].store(0, std::memory_order_relaxed);
+		}
+		
+		void addTo(std::unordered_map<std::string, Entry> & sums, const std::string & name) const
+		{
+			std::unordered_map<std::string, Entry>::iterator it = sums.find(name);
+			if (it == sums.end()) {
+				Entry e = Entry();
+				e.name = name;
+				it = sums.insert(std::make_pair(name, e)).first;
+			}
+			Entry & e = it->second;
+			e.calls += calls.load(std::memory_order_relaxed);
+			e.failures += failures.load(std::memory_order_relaxed);
+			e.missing += missing.load(std::memory_order_relaxed);
+			e.nanoseconds += nanoseconds.load(std::memory_order_relaxed);
+			for (int i = 0; i < BUCKETS; i++)
+				e.buckets[i] += buckets[i].load(std::memory_order_relaxed);
+		}
+	};
+	
+	typedef std::unordered_map<std::string, Counters *> Table;
+	
+	/** Tables of all threads. Adding counters to a table and reading the
+	 tables of other threads takes the mutex. */
+	struct Registry {
+		std::mutex mutex;
+		std::vector<Table *> threads;
+		/** Counters of threads that have finished. */
+		Table retired;
+	};
+	
+	/** Table of the calling thread, which registers itself on creation and
+	 hands its counters to the registry when the thread finishes. */
+	struct Thread {
+		Table table;
+		
+		Thread()
+		{
+			Registry & r = registry();
+			std::lock_guard<std::mutex> lock(r.mutex);
+			r.threads.push_back(&table);
+		}
+		
+		~Thread()
+		{
+			Registry & r = registry();
+			std::lock_guard<std::mutex> lock(r.mutex);
+			for (size_t i = 0; i < r.threads.size(); i++) {
+				if (r.threads[i] == &table) {
+					r.threads.erase(r.threads.begin() + i);
+					break;
+				}
+			}
+			for (Table::iterator it = table.begin(); it != table.end(); ++it) {
+				Counters *& retired = r.retired[it->first];
+				if (!retired) {
+					retired = it->second;
+					continue;
+				}
+				retired->calls += it->second->calls;
+				retired->failures += it->second->failures;
+				retired->missing += it->second->missing;
+				retired->nanoseconds += it->second->nanoseconds;
+				for (int i = 0; i < BUCKETS; i++)
+					retired->buckets[i] += it->second->buckets[i];
+				delete it->second;
+			}
+		}
+	};
+	
+	static Registry & registry()
+	{
+		static Registry r;
+		return r;
+	}
+	
+	/** Number of entries of the per-thread cache of recently used counters. */
+	static const int CACHE_SIZE = 64;
+	
+	/** Counters recently used by the calling thread, by the class table of
+	 the instance and the method name. */
+	struct Cached {
+		const void * cls;
+		std::string fn;
+		Counters * counters;
+	};
+	
+	/** Returns the counters of the calling thread for the given method of the
+	 class of the instance at the given index. */
+	static Counters * find(lua_State * L, int index, const char * fn)
+	{
+		static thread_local Thread thread;
+		static thread_local Cached cache[CACHE_SIZE];
+		if (!fn)
+			fn = "?";
+		
+		//Look for the counters among the recently used ones first, which avoids
+		//looking up the class name.
+		const void * cls = NULL;
+		if (lua_getmetatable(L, index)) {
+			cls = lua_topointer(L, -1);
+			lua_pop(L, 1);
+		}
+		Cached & cached = cache[((uintptr_t)cls >> 4 ^ (uintptr_t)fn >> 3) % CACHE_SIZE];
+		if (cached.counters && cached.cls == cls && cached.fn == fn)
+			return cached.counters;
+		
+		std::string key = "?";
+		if (lua_istable(L, index) || lua_isuserdata(L, index)) {
+			lua_getfield(L, index, "__class");
+			if (lua_isstring(L, -1))
+				key = lua_tostring(L, -1);
+			lua_pop(L, 1);
+		}
+		key += ':';
+		key += fn;
+		
+		Table::iterator it = thread.table.find(key);
+		Counters * c;
+		if (it != thread.table.end()) {
+			c = it->second;
+		} else {
+			c = new Counters;
+			std::lock_guard<std::mutex> lock(registry().mutex);
+			thread.table[key] = c;
+		}
+		cached.cls = cls;
+		cached.fn = fn;
+		cached.counters = c;
+		return c;
+	}
+	
+	/** Adds to a counter only written by the calling thread. */
+	static void increment(std::atomic<uint64_t> & counter, uint64_t n = 1)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	
+	static int bucket(uint64_t ns)
+	{
+		int b = 0;
+		while (ns > 1 && b < BUCKETS - 1) {
+			ns >>= 1;
+			b++;
+		}
+		return b;
+	}
+	
+	static bool byName(const Entry & a, const Entry & b) { return a.name < b.name; }
+	
+	static void setNumber(lua_State * L, const char * field, uint64_t value)
+	{
+		lua_pushnumber(L, (lua_Number)value);
+		lua_setfield(L, -2, field);
+	}
+};
+#endif
@@ -0,0 +1,461 @@
+#pragma once
+#include "lua.h"
+
+
+/** Implements the representation of exposed objects as a single userdata, as
+ opposed to a table holding the object pointer in a separate __this userdata.
+ The userdata carries the object pointer and has the class table as its meta-
+ table. Fields assigned to an instance are kept in the userdata's environment
+ table, which is only created on the first assignment. Until then the environ-
+ ment is the class's method table.
+ 
+ Classes whose instances are userdata use the index and newindex closures of
+ this class as their __index and __newindex fields. Subclasses created through
+ LuaClass::make inherit this.
+ 
+ The same closures implement properties, i.e. fields of the C++ object that
+ are read and written from Lua like regular fields. The properties of a class
+ are kept in its __properties table, which maps their interned names to their
+ accessors, so dispatching a key costs a single table lookup. Keys which are
+ no properties fall through to the instance's fields and the methods. Classes
+ with properties use the closures regardless of how their instances are
+ represented. */
+class LuaObject {
+public:
+	struct Data;
+	
+	/** Function called when the userdata holding an object is collected. */
+	typedef void (*Finalizer)(void * object, Data * data);
+	
+	/** Accessors of a property, which convert between a field of the C++
+	 object and the Lua stack. */
+	struct Property {
+		/** Pushes the value of the property of the given object. */
+		void (*get)(lua_State * L, void * object);
+		/** Assigns the value at the given index to the property. NULL if the
+		 property is read-only. */
+		void (*set)(lua_State * L, void * object, int index);
+	};
+	
+	/** Memory block of a userdata instance, also used for the __this userdata
+	 of table instances. */
+	struct Data {
+		/** Pointer to the C++ object, NULL once the object has been deleted. */
+		void * object;
+		/** Identity of the metatable the instance was created with. This allows
+		 the instance to be recognized by a pointer comparison. */
+		const void * meta;
+		/** Tag of the C++ class the object was exposed as, which tells objects
+		 of different classes apart. */
+		const void * type;
+		/** Called with the object when the userdata is collected. */
+		Finalizer finalize;
+	};
+	
+	/** Makes instances of the class table at the given index userdata. */
+	static void makeClass(lua_State * L, int cls)
+	{
+		if (cls < 0)
+			cls += lua_gettop(L) + 1;
+		
+		dispatch(L, cls);
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, lua_gc);
+		lua_rawset(L, cls);
+	}
+	
+	/** Returns whether instances of the class table at the given index are
+	 userdata. */
+	static bool isClass(lua_State * L, int cls)
+	{
+		lua_getfield(L, cls, "__gc");
+		bool result = (lua_tocfunction(L, -1) == lua_gc);
+		lua_pop(L, 1);
+		return result;
+	}
+	
+	/** Adds the property with the given name to the class table at the given
+	 index. The accessors must outlive the state. Subclasses created before
+	 receive the property as well, unless they declare their own under the
+	 same name. */
+	static void addProperty(lua_State * L, int cls, const char * name, const Property * property)
+	{
+		if (cls < 0)
+			cls += lua_gettop(L) + 1;
+		setProperty(L, cls, name, property, NULL, true);
+	}
+	
+	/** Gives the class table at index cls a copy of the properties of the
+	 superclass at the given index. */
+	static void inheritProperties(lua_State * L, int cls, int superclass)
+	{
+		if (cls < 0)
+			cls += lua_gettop(L) + 1;
+		if (superclass < 0)
+			superclass += lua_gettop(L) + 1;
+		lua_pushliteral(L, "__properties");
+		lua_rawget(L, superclass);
+		if (lua_istable(L, -1)) {
+			lua_pushliteral(L, "__properties");
+			lua_newtable(L);
+			for (lua_pushnil(L); lua_next(L, -4); lua_pop(L, 1)) {
+				lua_pushvalue(L, -2);
+				lua_pushvalue(L, -2);
+				lua_rawset(L, -5);
+			}
+			lua_rawset(L, cls);
+			dispatch(L, cls);
+		}
+		lua_pop(L, 1);
+	}
+	
+	/** Pushes a new userdata pointing to the given object of the class tagged
+	 type. A userdata instance still needs to be bound to its class, the __this
+	 userdata of a table instance needs its finalizer to be attached. */
+	static Data * create(lua_State * L, void * object, Finalizer finalize = NULL, const void * type = NULL)
+	{
+		Data * data = (Data *)lua_newuserdata(L, sizeof(Data));
+		data->object = object;
+		data->meta = NULL;
+		data->type = type;
+		data->finalize = finalize;
+		return data;
+	}
+	
+	/** Sets the metatable of the userdata at the given index to the shared
+	 metatable which calls the finalizer upon collection. */
+	static void attachFinalizer(lua_State * L, int index)
+	{
+		if (index < 0)
+			index += lua_gettop(L) + 1;
+		
+		//Fetch the shared metatable, creating it if required.
+		lua_pushlightuserdata(L, (void *)&attachFinalizer);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushcfunction(L, lua_gc);
+			lua_setfield(L, -2, "__gc");
+			lua_pushlightuserdata(L, (void *)&attachFinalizer);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, LUA_REGISTRYINDEX);
+		}
+		
+		Data * data = (Data *)lua_touserdata(L, index);
+		data->meta = lua_topointer(L, -1);
+		lua_setmetatable(L, index);
+	}
+	
+	/** Pushes the instance weakly associated with the given key, or nil if
+	 there is none or it has been collected. Exposed objects are associated
+	 with their instance under their pointer, so this is the identity map from
+	 C++ objects to their instances. */
+	static void pushInstance(lua_State * L, void * key)
+	{
+		pushInstances(L);
+		lua_pushlightuserdata(L, key);
+		lua_rawget(L, -2);
+		lua_remove(L, -2);
+	}
+	
+	/** Weakly associates the instance at the given index with the key. The
+	 association does not keep the instance from being collected. Pass an
+	 index of 0 to remove the association. */
+	static void setInstance(lua_State * L, void * key, int index)
+	{
+		if (index < 0)
+			index += lua_gettop(L) + 1;
+		pushInstances(L);
+		lua_pushlightuserdata(L, key);
+		if (index)
+			lua_pushvalue(L, index);
+		else
+			lua_pushnil(L);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+	}
+	
+	/** Keeps the instance at the given index alive until the association with
+	 the key is removed by passing an index of 0. Unlike registry references,
+	 anchors are kept in a hash table by key, so anchoring many objects causes
+	 no free list churn. */
+	static void setAnchor(lua_State * L, void * key, int index)
+	{
+		if (index < 0)
+			index += lua_gettop(L) + 1;
+		pushAnchors(L);
+		lua_pushlightuserdata(L, key);
+		if (index)
+			lua_pushvalue(L, index);
+		else
+			lua_pushnil(L);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+	}
+	
+	/** Pushes an array of the live instances whose metatable is the class
+	 table at the given index. The size hint presizes the array. Only the
+	 instances in the identity map are visited, not the whole heap. */
+	static void pushInstancesOf(lua_State * L, int cls, int size = 0)
+	{
+		if (cls < 0)
+			cls += lua_gettop(L) + 1;
+		lua_createtable(L, size, 0);
+		int result = lua_gettop(L);
+		pushInstances(L);
+		int n = 0;
+		for (lua_pushnil(L); lua_next(L, result + 1); lua_pop(L, 1)) {
+			if (!lua_getmetatable(L, -1))
+				continue;
+			if (lua_rawequal(L, -1, cls)) {
+				lua_pushvalue(L, -2);
+				lua_rawseti(L, result, ++n);
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	
+	/** Binds the userdata instance at the given index to the class table at
+	 index cls. The caller is responsible for setting the metatable. */
+	static void bind(lua_State * L, int index, int cls)
+	{
+		if (index < 0)
+			index += lua_gettop(L) + 1;
+		Data * data = (Data *)lua_touserdata(L, index);
+		data->meta = lua_topointer(L, cls);
+		lua_getfield(L, cls, "__methods");
+		lua_setfenv(L, index);
+	}
+	
+	/** Returns the data of the userdata instance at the given index, or NULL if
+	 the value is no such instance. If a type is given, instances of objects of
+	 other classes are rejected as well. */
+	static Data * toData(lua_State * L, int index, const void * type = NULL)
+	{
+		if (lua_type(L, index) != LUA_TUSERDATA || lua_objlen(L, index) != sizeof(Data))
+			return NULL;
+		Data * data = (Data *)lua_touserdata(L, index);
+		if (type && data->type != type)
+			return NULL;
+		if (!lua_getmetatable(L, index))
+			return NULL;
+		bool valid = (lua_topointer(L, -1) == data->meta);
+		lua_pop(L, 1);
+		return (valid ? data : NULL);
+	}
+	
+	/** Returns whether the value at the given index is the instance of an
+	 exposed object which has been deleted since. */
+	static bool isDeleted(lua_State * L, int index)
+	{
+		if (index < 0)
+			index += lua_gettop(L) + 1;
+		Data * data = toData(L, index);
+		if (!data && lua_istable(L, index)) {
+			lua_pushliteral(L, "__this");
+			lua_rawget(L, index);
+			if (lua_type(L, -1) == LUA_TUSERDATA)
+				data = (Data *)lua_touserdata(L, -1);
+			lua_pop(L, 1);
+		}
+		return (data && !data->object);
+	}
+	
+private:
+	/** Pushes the table holding the weakly associated instances, creating it
+	 if required. */
+	static void pushInstances(lua_State * L)
+	{
+		lua_pushlightuserdata(L, (void *)&pushInstances);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_newtable(L);
+			lua_pushliteral(L, "v");
+			lua_setfield(L, -2, "__mode");
+			lua_setmetatable(L, -2);
+			lua_pushlightuserdata(L, (void *)&pushInstances);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, LUA_REGISTRYINDEX);
+		}
+	}
+	
+	/** Pushes the table holding the anchored instances, creating it if
+	 required. */
+	static void pushAnchors(lua_State * L)
+	{
+		lua_pushlightuserdata(L, (void *)&pushAnchors);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushlightuserdata(L, (void *)&pushAnchors);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, LUA_REGISTRYINDEX);
+		}
+	}
+	
+	/** __gc metamethod of userdata instances and __this userdata. Calls the
+	 finalizer of the object, unless it has already been deleted. */
+	static int lua_gc(lua_State * L)
+	{
+		Data * data = (Data *)lua_touserdata(L, 1);
+		if (data && data->object && data->finalize)
+			data->finalize(data->object, data);
+		if (data)
+			data->object = NULL;
+		return 0;
+	}
+	
+	/** Sets the property with the given name of the class table at index cls
+	 and passes it on to its subclasses. Subclasses whose property differs from
+	 the one they inherited, i.e. the previous property of their superclass,
+	 have declared their own and keep it. */
+	static void setProperty(lua_State * L, int cls, const char * name, const Property * property,
+							const Property * inherited, bool declared)
+	{
+		lua_pushliteral(L, "__properties");
+		lua_rawget(L, cls);
+		if (!lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushliteral(L, "__properties");
+			lua_pushvalue(L, -2);
+			lua_rawset(L, cls);
+			dispatch(L, cls);
+		}
+		lua_getfield(L, -1, name);
+		const Property * previous = (const Property *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if (!declared && previous && previous != inherited) {
+			lua_pop(L, 1);
+			return;
+		}
+		lua_pushlightuserdata(L, (void *)property);
+		lua_setfield(L, -2, name);
+		lua_pop(L, 1);
+		
+		lua_getfield(L, cls, "__subclasses");
+		if (lua_istable(L, -1)) {
+			int subclasses = lua_gettop(L);
+			int n = lua_objlen(L, subclasses);
+			for (int i = 1; i <= n; i++) {
+				lua_rawgeti(L, subclasses, i);
+				setProperty(L, lua_gettop(L), name, property, previous, false);
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+	
+	/** Sets the __index and __newindex fields of the class table at the given
+	 index to closures over its method and property tables. */
+	static void dispatch(lua_State * L, int cls)
+	{
+		lua_pushliteral(L, "__index");
+		lua_getfield(L, cls, "__methods");
+		lua_pushliteral(L, "__properties");
+		lua_rawget(L, cls);
+		lua_pushcclosure(L, lua_index, 2);
+		lua_rawset(L, cls);
+		
+		lua_pushliteral(L, "__newindex");
+		lua_getfield(L, cls, "__methods");
+		lua_pushliteral(L, "__properties");
+		lua_rawget(L, cls);
+		lua_pushcclosure(L, lua_newindex, 2);
+		lua_rawset(L, cls);
+	}
+	
+	/** Returns the property named by the key at index 2 if the class has
+	 properties, or NULL otherwise. The property table is the second upvalue of
+	 the dispatching closures. */
+	static const Property * toProperty(lua_State * L)
+	{
+		if (!lua_istable(L, lua_upvalueindex(2)))
+			return NULL;
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(2));
+		const Property * property = (const Property *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		return property;
+	}
+	
+	/** Returns the object of the instance at index 1, raising an error if the
+	 object has been deleted. */
+	static void * toObject(lua_State * L)
+	{
+		Data * data;
+		if (lua_type(L, 1) == LUA_TUSERDATA) {
+			data = (Data *)lua_touserdata(L, 1);
+		} else {
+			lua_pushliteral(L, "__this");
+			lua_rawget(L, 1);
+			data = (Data *)lua_touserdata(L, -1);
+			lua_pop(L, 1);
+		}
+		if (!data || !data->object)
+			luaL_error(L, "Property %s accessed on a deleted object.", lua_tostring(L, 2));
+		return data->object;
+	}
+	
+	/** __index closure of the class. The method and property tables are its
+	 upvalues. Looks the key up in the properties first, then in the instance's
+	 fields, then in the methods. */
+	static int lua_index(lua_State * L)
+	{
+		const Property * property = toProperty(L);
+		if (property) {
+			property->get(L, toObject(L));
+			return 1;
+		}
+		if (lua_type(L, 1) == LUA_TUSERDATA) {
+			lua_getfenv(L, 1);
+			if (!lua_rawequal(L, -1, lua_upvalueindex(1))) {
+				lua_pushvalue(L, 2);
+				lua_rawget(L, -2);
+				if (!lua_isnil(L, -1))
+					return 1;
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+		lua_pushvalue(L, 2);
+		lua_gettable(L, lua_upvalueindex(1));
+		return 1;
+	}
+	
+	/** __newindex closure of the class. The method and property tables are
+	 its upvalues. Assigns properties to the object, anything else to the
+	 instance's fields. Creates the field table of userdata instances on the
+	 first assignment. */
+	static int lua_newindex(lua_State * L)
+	{
+		lua_settop(L, 3);
+		const Property * property = toProperty(L);
+		if (property) {
+			if (!property->set)
+				return luaL_error(L, "Property %s is read-only.", lua_tostring(L, 2));
+			property->set(L, toObject(L), 3);
+			return 0;
+		}
+		if (lua_type(L, 1) != LUA_TUSERDATA) {
+			lua_rawset(L, 1);
+			return 0;
+		}
+		
+		lua_getfenv(L, 1);
+		if (lua_rawequal(L, -1, lua_upvalueindex(1))) {
+			lua_pop(L, 1);
+			lua_createtable(L, 0, 4);
+			lua_pushvalue(L, -1);
+			lua_setfenv(L, 1);
+		}
+		lua_insert(L, 2);
+		lua_rawset(L, 2);
+		return 0;
+	}
+};
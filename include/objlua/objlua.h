@@ -1,12 +1,27 @@
 #pragma once
 
+#include "alloc.h"
+#include "buffer.h"
 #include "class.h"
+#include "batch.h"
+#include "bytecode.h"
 #include "describe.h"
+#include "embedded.h"
 #include "error.h"
+#include "eventbus.h"
 #include "exposable.h"
 #include "lua.h"
+#include "method.h"
+#include "metrics.h"
+#include "object.h"
+#include "pool.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "snapshot.h"
 #include "stack.h"
 #include "state.h"
+#include "statepool.h"
+#include "value.h"
 
 
 /*!
@@ -36,6 +51,48 @@
  lua.dofile("myscript.lua");
  @endcode
  
+ Scripts may be loaded through a bytecode cache, which keeps the compiled
+ chunks on disk and skips parsing on later loads. Chunks are recompiled when
+ their script changes.
+ @code
+ LuaBytecodeCache cache(".luacache");
+ lua.setBytecodeCache(&cache);
+ @endcode
+ 
+ Scripts may also be compiled at build time and embedded into the binary with
+ the objlua_embed_scripts function of cmake/ObjectiveLua.cmake. dofile and
+ require find embedded scripts under their path without any file I/O.
+ @code
+ include(ObjectiveLua.cmake)
+ objlua_embed_scripts(game SCRIPTS scripts/sprite.lua scripts/main.lua)
+ @endcode
+ 
+ @subsection Memory
+ By default a state serves Lua's small allocations from size-class pools and
+ keeps track of the memory it uses. You may also pass your own allocator, or
+ limit the memory a state may use.
+ @code
+ LuaHeapAllocator heap;
+ LuaState lua(heap);
+ lua.getAllocator()->setLimit(16 * 1024 * 1024);
+ std::cout << lua.getAllocator()->getStats().peak << " bytes at most\n";
+ @endcode
+ 
+ @subsection Multiple Cores
+ A LuaStatePool keeps several independent states, each driven by a thread of
+ its own and set up by the same function. Jobs are spread across the states by
+ work stealing. Objects live in the state they were created in, so jobs
+ touching an object are pinned to that state.
+ @code
+ LuaStatePool pool(0, [](LuaState & L) {
+	 LuaClass::install(L);
+	 Sprite::expose(L);
+ });
+ pool.submit([](LuaState & L) { L.dofile("scripts/simulate.lua"); });
+ pool.submit(sprite->getState(), [=](LuaState & L) { sprite->animate(); });
+ pool.wait();
+ @endcode
+ 
  @subsection Errors
  @code
  //Reports and pops the error on top of the stack of the Lua state L.
@@ -55,6 +112,26 @@
  dump(myVar)
  @endcode
  
+ Values may also be saved in a compact binary snapshot and restored later.
+ Shared and cyclic tables as well as instances of classes survive the round
+ trip; exposed objects are recreated through their class.
+ @code
+ LuaSnapshot::save(L, -1, "world.snapshot");
+ LuaSnapshot::load(L, "world.snapshot");
+ @endcode
+ 
+ @subsection Profiling
+ A LuaProfiler samples the call stack of a state at a regular interval while
+ it runs. Methods are named after their class, e.g. Sprite:say, and the
+ samples can be written as a top list or as folded stacks for flame graphs.
+ @code
+ LuaProfiler profiler(L);
+ profiler.start(500);
+ lua.dofile("scripts/main.lua");
+ profiler.stop();
+ profiler.writeTop(std::cout, 10);
+ @endcode
+ 
  @subsection Stack
  The following dumps the entire Lua stack to the console. This function is
  pretty handy for debugging your Lua-exposed objects.
@@ -67,6 +144,136 @@
  @endcode
  
  
+ @subsection Calling Lua Functions
+ Exposed objects may call the Lua functions defined on their class. The
+ arguments are marshalled according to their C++ types at compile time, and
+ the expected return types are given as template arguments.
+ @code
+ sprite->call("animate", 1.0, "x", otherSprite);
+ std::optional<int> n = sprite->call<int>("count");
+ @endcode
+ Hooks that are called on many objects may be looked up once through a method
+ handle. The handle caches the resolved function per class and notices when
+ the class is modified.
+ @code
+ LuaMethod animate(lua, "animate");
+ for (Sprite * sprite : sprites)
+	 sprite->call(animate, dt);
+ @endcode
+ Calling the hook on all of them in a batch also pushes the arguments only
+ once. Errors are reported per object and do not abort the batch.
+ @code
+ LuaBatch::Result r = LuaBatch::call(sprites, animate, dt);
+ @endcode
+ Optional hooks which most classes do not implement may be declared once. Each
+ class caches whether it implements the declared hooks until it is modified,
+ so calling a missing hook returns right away.
+ @code
+ static const LuaHook onFrame("onFrame");
+ sprite->call(onFrame, dt);
+ @endcode
+ Events that only some objects handle are better sent through an event bus.
+ It indexes its subscribers by the handlers their classes implement, so a
+ broadcast only visits the objects that handle the event.
+ @code
+ LuaEventBus bus(lua);
+ bus.subscribe(sprite);
+ bus.broadcast("onHit", damage);
+ @endcode
+ If the library is compiled with OBJLUA_METRICS defined, these calls are
+ counted per class and method, together with failures, calls to missing
+ methods and a latency histogram. Otherwise they are made directly.
+ @code
+ LuaMetrics::write(std::cout);
+ @endcode
+ Also available in Lua:
+ @code
+ print(metrics()["Sprite:animate"].p99)
+ @endcode
+ Member functions are exposed as methods through thunks generated at compile
+ time, which check and convert the arguments according to the function's
+ signature.
+ @code
+ static const luaL_Reg functions[] = {
+	 {"say", OBJLUA_METHOD(&Sprite::say)},
+	 {NULL, NULL}
+ };
+ @endcode
+ Methods may also run as coroutines, which wait for some time or for an event
+ by calling wait or waitFor. A scheduler resumes the coroutines that are due
+ once per update, so objects waiting for a long time cost nothing per update.
+ @code
+ LuaScheduler scheduler(lua);
+ scheduler.start(guard, "patrol", 10.0);
+ scheduler.update(dt);
+ scheduler.signal("alarm");
+ @endcode
+ 
+ 
+ @subsection Object Representation
+ By default an exposed object is a Lua table holding the C++ pointer in a
+ __this userdata. Classes may instead be represented by a single userdata per
+ object, which halves the allocations and speeds up fromStack:
+ @code
+ template <> struct LuaExposableTraits<Sprite> : LuaExposableDefaults {
+	 static const bool userdata = true;
+ };
+ @endcode
+ Scripts can assign and read fields of such objects as usual.
+ 
+ Fields of the C++ object may be exposed as properties, which scripts read and
+ write like fields of the instance. The value lives in the object only, so C++
+ code accesses it directly.
+ @code
+ LuaExposable<Sprite>::expose(L);
+ OBJLUA_PROPERTY(name, &Sprite::name);
+ @endcode
+ 
+ Arrays of numbers owned by an object may be handed to scripts as buffers,
+ which view the array in place instead of copying it into a table. Buffers
+ are indexed like tables and have bulk methods such as fill, copy, map and
+ sum. Accessing a buffer after its owner was deleted raises an error.
+ @code
+ LuaBuffer::push(L, sprite, sprite->samples);
+ lua_setglobal(L, "samples");
+ @endcode
+ 
+ @subsection Ownership
+ Each object has an ownership mode that decides who deletes it. Pinned objects
+ (the default) are deleted by C++ or by calling delete from a script. Objects
+ owned by Lua are deleted when their instance is garbage collected. Objects
+ owned by C++ only hold their instance weakly and recreate it when needed. Shared
+ objects are kept alive by retain and deleted once released and collected.
+ @code
+ template <> struct LuaExposableTraits<Bullet> : LuaExposableDefaults {
+	 static const LuaOwnership ownership = LUA_OWNED_BY_LUA;
+ };
+ sprite->setOwnership(LUA_SHARED);
+ sprite->retain();
+ @endcode
+ Instances are found from their object through an identity map keyed by the
+ object's pointer, which only anchors the instances the C++ side keeps alive.
+ The map also counts the objects per class and enumerates them.
+ @code
+ lua_getglobal(L, "Sprite");
+ std::cout << LuaClass::info(L, -1)->instances << " sprites\n";
+ LuaClass::pushInstances(L, -1);
+ @endcode
+ 
+ @subsection Object Pools
+ Classes whose objects are created and deleted at a high rate may take them
+ from a pool per state, which recycles their memory. Objects created by scripts
+ are pooled automatically; C++ code creates them with new (L). Pooled objects
+ still alive when the state is closed are deleted along with it.
+ @code
+ template <> struct LuaExposableTraits<Bullet> : LuaExposableDefaults {
+	 static const bool pooled = true;
+ };
+ Bullet * bullet = new (L) Bullet(L);
+ std::cout << Bullet::getPool(L)->getStats().peak << " bullets at most\n";
+ @endcode
+ 
+ 
  @section a Class Mechanism
  
  The LuaClass closure provides functions that allow for a basic class
@@ -100,4 +307,27 @@
  @endcode
  Note that you have to give the name of your new class as a string, but the
  superclass table directly.
+ 
+ Classes may also be loaded lazily. Registering a class for autoloading defers
+ exposing it and running its script until a script first uses the class.
+ @code
+ LuaClass::autoload(lua, "Sprite", Sprite::expose, "scripts/sprite.lua");
+ LuaClass::AutoloadStats stats = LuaClass::getAutoloadStats(lua);
+ @endcode
+ 
+ A class script that has changed may be reloaded without restarting the
+ state. The methods it defines are patched into the existing class tables, so
+ live instances pick them up right away.
+ @code
+ LuaClass::reload(lua, "scripts/sprite.lua");
+ @endcode
+ 
+ Once a class hierarchy is set up, it may be flattened. This copies inherited
+ methods into each subclass, so calling a method no longer gets slower the
+ deeper the class is in the hierarchy. Methods later assigned to a superclass
+ are passed on to its flattened subclasses.
+ @code
+ lua_getglobal(lua, "MySuperclass");
+ LuaClass::flatten(lua, -1);
+ @endcode
  */
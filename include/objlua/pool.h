@@ -0,0 +1,187 @@
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include "lua.h"
+
+
+/** Pool of equally sized blocks holding the C++ objects of one exposed class
+ in one Lua state. Objects are carved from slabs of increasing size and their
+ blocks are recycled when they are deleted, so creating and deleting objects
+ at a high rate does not go through the heap.
+ 
+ The pool lives in the registry of its state as a userdata. When the state is
+ closed, the objects still alive are deleted and all slabs are released at
+ once. Pooled objects must therefore not outlive their state.
+ 
+ Every block is preceded by a small header naming the pool it belongs to, so
+ objects may be deleted without knowing their state. Blocks of the wrong size,
+ e.g. for subclasses which are larger than the pooled class, come from the
+ heap. */
+class LuaObjectPool {
+public:
+	/** Function which deletes an object still alive when the pool is torn
+	 down. */
+	typedef void (*Destructor)(void * object);
+	
+	/** Occupancy statistics of a pool. */
+	struct Stats {
+		/** Number of objects currently alive. */
+		size_t live;
+		/** Highest number of objects alive at once. */
+		size_t peak;
+		/** Number of blocks in the slabs, used or not. */
+		size_t capacity;
+		/** Number of objects allocated over the lifetime of the pool. */
+		size_t allocations;
+	};
+	
+	/** Number of blocks in the first slab. Each further slab is twice as large,
+	 up to MAX_SLAB blocks. */
+	static const size_t MIN_SLAB = 16;
+	static const size_t MAX_SLAB = 1024;
+	
+	/** Returns the pool registered under the given key in the state, or NULL
+	 if there is none. */
+	static LuaObjectPool * find(lua_State * L, void * key)
+	{
+		lua_pushlightuserdata(L, key);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		LuaObjectPool * pool = (LuaObjectPool *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		return pool;
+	}
+	
+	/** Returns the pool registered under the given key in the state, creating
+	 it for objects of the given size if required. */
+	static LuaObjectPool * get(lua_State * L, void * key, size_t size, Destructor destroy)
+	{
+		LuaObjectPool * pool = find(L, key);
+		if (pool)
+			return pool;
+		
+		pool = new (lua_newuserdata(L, sizeof(LuaObjectPool))) LuaObjectPool(size, destroy);
+		lua_newtable(L);
+		lua_pushcfunction(L, lua_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_setmetatable(L, -2);
+		lua_pushlightuserdata(L, key);
+		lua_insert(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+		return pool;
+	}
+	
+	/** Allocates a block of the given size from the pool, or from the heap if
+	 the pool is NULL or serves blocks of a different size. Throws
+	 std::bad_alloc on failure, like operator new. */
+	static void * allocate(LuaObjectPool * pool, size_t size)
+	{
+		if (!pool || size != pool->size) {
+			Header * header = (Header *)::operator new(sizeof(Header) + size);
+			header->pool = NULL;
+			header->live = true;
+			return header + 1;
+		}
+		
+		if (!pool->available)
+			pool->refill();
+		Header * header = pool->available;
+		pool->available = *(Header **)(header + 1);
+		header->live = true;
+		
+		Stats & s = pool->statistics;
+		s.allocations++;
+		if (++s.live > s.peak)
+			s.peak = s.live;
+		return header + 1;
+	}
+	
+	/** Returns the block of the given object to the pool it came from. */
+	static void deallocate(void * object)
+	{
+		if (!object)
+			return;
+		Header * header = (Header *)object - 1;
+		LuaObjectPool * pool = header->pool;
+		if (!pool) {
+			::operator delete(header);
+			return;
+		}
+		header->live = false;
+		*(Header **)object = pool->available;
+		pool->available = header;
+		pool->statistics.live--;
+	}
+	
+	/** Returns the occupancy statistics. */
+	const Stats & getStats() const { return statistics; }
+	
+	/** Returns the size of the objects served from the pool. */
+	size_t getSize() const { return size; }
+	
+private:
+	/** Header preceding every block. Aligned such that the object following
+	 it is suitably aligned for any type. */
+	struct alignas(std::max_align_t) Header {
+		LuaObjectPool * pool;
+		bool live;
+	};
+	
+	size_t size;
+	size_t stride;
+	Destructor destroy;
+	Header * available;
+	std::vector<std::pair<char *, size_t> > slabs;
+	Stats statistics;
+	
+	LuaObjectPool(size_t size, Destructor destroy) : size(size), destroy(destroy), available(NULL)
+	{
+		stride = sizeof(Header) + (size + alignof(std::max_align_t) - 1) /
+			alignof(std::max_align_t) * alignof(std::max_align_t);
+		statistics.live = statistics.peak = statistics.capacity = statistics.allocations = 0;
+	}
+	
+	/** Deletes the objects still alive and releases the slabs. */
+	~LuaObjectPool()
+	{
+		for (size_t i = 0; i < slabs.size(); i++) {
+			for (size_t n = 0; n < slabs[i].second; n++) {
+				Header * header = (Header *)(slabs[i].first + n * stride);
+				if (header->live)
+					destroy(header + 1);
+			}
+		}
+		for (size_t i = 0; i < slabs.size(); i++)
+			free(slabs[i].first);
+	}
+	
+	/** Adds a new slab to the pool. */
+	void refill()
+	{
+		size_t n = (slabs.empty() ? MIN_SLAB : slabs.back().second * 2);
+		if (n > MAX_SLAB)
+			n = MAX_SLAB;
+		char * slab = (char *)malloc(n * stride);
+		if (!slab)
+			throw std::bad_alloc();
+		slabs.push_back(std::make_pair(slab, n));
+		statistics.capacity += n;
+		
+		for (size_t i = n; i > 0; i--) {
+			Header * header = (Header *)(slab + (i - 1) * stride);
+			header->pool = this;
+			header->live = false;
+			*(Header **)(header + 1) = available;
+			available = header;
+		}
+	}
+	
+	/** __gc metamethod of the pool userdata, called when the state is closed. */
+	static int lua_gc(lua_State * L)
+	{
+		LuaObjectPool * pool = (LuaObjectPool *)lua_touserdata(L, 1);
+		pool->~LuaObjectPool();
+		return 0;
+	}
+};
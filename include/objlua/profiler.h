@@ -0,0 +1,342 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "lua.h"
+
+
+/** Sampling profiler for the Lua code running in a state. While the profiler
+ runs, a hook checks the clock every few hundred instructions as well as on
+ every call and return, and records the call stack whenever a sampling
+ interval has passed. Time spent in C++ functions called from Lua is sampled
+ when they call back into Lua or return, so it is attributed to the C++
+ function rather than its caller.
+ 
+ Frames are named after the class a method is defined in, e.g. Sprite:say,
+ which is found through the method tables of the first argument's class. This
+ covers methods defined in scripts and the C++ functions exposed on a class
+ alike. Other functions are named after their source location.
+ 
+ The profiler only installs a hook while it runs, so a stopped profiler costs
+ nothing. It has to be stopped before the state is closed.
+ 
+ @code
+ LuaProfiler profiler(L);
+ profiler.start();
+ L.dofile("scripts/main.lua");
+ profiler.stop();
+ profiler.writeTop(std::cout);
+ profiler.writeFolded(out); //Input for flamegraph.pl.
+ @endcode */
+class LuaProfiler {
+public:
+	/** Creates a profiler for the given state, which is not running yet. */
+	LuaProfiler(lua_State * L) : L(L), interval(0), last(0), samples(0), running(false) {}
+	~LuaProfiler() { stop(); }
+	
+	/** Starts sampling the state every given number of microseconds. Samples
+	 recorded earlier are kept. Only one profiler may run per state. */
+	void start(unsigned microseconds = 1000)
+	{
+		if (running)
+			stop();
+		interval = (int64_t)(microseconds ? microseconds : 1) * 1000;
+		last = now();
+		
+		lua_pushlightuserdata(L, key());
+		lua_newtable(L);
+		lua_pushlightuserdata(L, this);
+		lua_rawseti(L, -2, 1);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+		lua_sethook(L, hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, INSTRUCTIONS);
+		running = true;
+	}
+	
+	/** Stops sampling and removes the hook. Coroutines that inherited the hook
+	 remove it the next time it fires. */
+	void stop()
+	{
+		if (!running)
+			return;
+		lua_sethook(L, NULL, 0, 0);
+		lua_pushlightuserdata(L, key());
+		lua_pushnil(L);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+		running = false;
+	}
+	
+	bool isRunning() const { return running; }
+	
+	/** Discards the samples recorded so far. */
+	void reset()
+	{
+		stacks.clear();
+		samples = 0;
+	}
+	
+	/** Returns the number of samples recorded so far. */
+	size_t getSamples() const { return samples; }
+	
+	/** Writes the recorded stacks in the folded format understood by
+	 flamegraph.pl, one line per stack with its frames from the outermost to
+	 the innermost, separated by semicolons and followed by the number of
+	 samples. */
+	void writeFolded(std::ostream & out) const
+	{
+		std::map<std::string, size_t> sorted(stacks.begin(), stacks.end());
+		for (std::map<std::string, size_t>::iterator it = sorted.begin(); it != sorted.end(); ++it)
+			out << it->first << " " << it->second << "\n";
+	}
+	
+	/** Writes a table of the given number of frames with the most samples in
+	 the frame itself. The total includes the samples in the functions the
+	 frame called. */
+	void writeTop(std::ostream & out, size_t count = 20) const
+	{
+		//Sum up the samples per frame. A frame appearing several times in one
+		//stack, e.g. through recursion, is only counted once towards its total.
+		std::unordered_map<std::string, std::pair<size_t, size_t> > frames;
+		for (std::unordered_map<std::string, size_t>::const_iterator it = stacks.begin();
+			 it != stacks.end(); ++it) {
+			std::vector<std::string> seen;
+			size_t start = 0;
+			while (true) {
+				size_t end = it->first.find(';', start);
+				std::string frame = it->first.substr(start, end - start);
+				if (std::find(seen.begin(), seen.end(), frame) == seen.end()) {
+					frames[frame].second += it->second;
+					seen.push_back(frame);
+				}
+				if (end == std::string::npos) {
+					frames[frame].first += it->second;
+					break;
+				}
+				start = end + 1;
+			}
+		}
+		
+		std::vector<std::pair<std::string, std::pair<size_t, size_t> > > sorted(frames.begin(), frames.end());
+		std::sort(sorted.begin(), sorted.end(), compareSelf);
+		if (sorted.size() > count)
+			sorted.resize(count);
+		
+		char line[64];
+		snprintf(line, sizeof(line), "%8s %7s %8s %7s  ", "self", "", "total", "");
+		out << line << "frame\n";
+		double total = (samples ? samples : 1);
+		for (size_t i = 0; i < sorted.size(); i++) {
+			size_t self = sorted[i].second.first, inclusive = sorted[i].second.second;
+			snprintf(line, sizeof(line), "%8zu %6.1f%% %8zu %6.1f%%  ",
+					 self, self * 100 / total, inclusive, inclusive * 100 / total);
+			out << line << sorted[i].first << "\n";
+		}
+	}
+	
+private:
+	/** Number of instructions between two checks of the clock. */
+	static const int INSTRUCTIONS = 200;
+	/** Number of frames recorded per sample, counted from the innermost. */
+	static const int MAX_DEPTH = 64;
+	
+	lua_State * L;
+	int64_t interval;
+	/** Time up to which the samples have been taken. */
+	int64_t last;
+	size_t samples;
+	bool running;
+	/** Number of samples per folded stack. */
+	std::unordered_map<std::string, size_t> stacks;
+	
+	LuaProfiler(const LuaProfiler &);
+	LuaProfiler & operator=(const LuaProfiler &);
+	
+	/** Registry key of the table holding the running profiler at index 1 and
+	 the names of the functions seen so far at index 2. */
+	static void * key()
+	{
+		static char key;
+		return &key;
+	}
+	
+	static int64_t now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	
+	static bool compareSelf(const std::pair<std::string, std::pair<size_t, size_t> > & a,
+							const std::pair<std::string, std::pair<size_t, size_t> > & b)
+	{
+		if (a.second.first != b.second.first)
+			return a.second.first > b.second.first;
+		return a.first < b.first;
+	}
+	
+	static void hook(lua_State * L, lua_Debug * ar)
+	{
+		lua_pushlightuserdata(L, key());
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		if (!lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			lua_sethook(L, NULL, 0, 0);
+			return;
+		}
+		lua_rawgeti(L, -1, 1);
+		LuaProfiler * profiler = (LuaProfiler *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		profiler->event(L, ar->event);
+		lua_pop(L, 1);
+	}
+	
+	/** Handles a hook event with the profiler's table on top of the stack. */
+	void event(lua_State * L, int event)
+	{
+		//Time spent outside of Lua before it was entered is not sampled.
+		int64_t t = now();
+		lua_Debug ar;
+		if (event == LUA_HOOKCALL && !lua_getstack(L, 1, &ar)) {
+			last = t;
+			return;
+		}
+		if (t - last < interval)
+			return;
+		
+		//Weigh the sample by the number of intervals that have passed, so C++
+		//functions are accounted for the whole time they ran.
+		size_t weight = (size_t)((t - last) / interval);
+		last += weight * interval;
+		
+		int depth = 0;
+		while (depth < MAX_DEPTH && lua_getstack(L, depth, &ar))
+			depth++;
+		if (!depth || !lua_checkstack(L, 8))
+			return;
+		lua_rawgeti(L, -1, 2);
+		std::string stack;
+		for (int level = depth - 1; level >= 0; level--) {
+			if (level < depth - 1)
+				stack += ';';
+			appendName(L, level, stack);
+		}
+		lua_pop(L, 1);
+		stacks[stack] += weight;
+		samples += weight;
+	}
+	
+	/** Appends the name of the function at the given level of the call stack,
+	 caching it in the table on top of the stack. */
+	static void appendName(lua_State * L, int level, std::string & out)
+	{
+		lua_Debug ar;
+		lua_getstack(L, level, &ar);
+		lua_getinfo(L, "f", &ar);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, -3);
+		if (!lua_isstring(L, -1)) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			resolve(L, level, lua_gettop(L));
+			lua_rawset(L, -4);
+			lua_pushvalue(L, -1);
+			lua_rawget(L, -3);
+		}
+		size_t length;
+		const char * name = lua_tolstring(L, -1, &length);
+		out.append(name, length);
+		lua_pop(L, 2);
+	}
+	
+	/** Pushes the name of the function at the given stack index, which is
+	 running at the given level of the call stack. */
+	static void resolve(lua_State * L, int level, int function)
+	{
+		lua_Debug ar;
+		lua_getstack(L, level, &ar);
+		lua_getinfo(L, "Sn", &ar);
+		if (method(L, &ar, function))
+			return;
+		if (ar.what && strcmp(ar.what, "C") == 0)
+			lua_pushstring(L, ar.name ? ar.name : "[C]");
+		else if (ar.what && strcmp(ar.what, "main") == 0)
+			lua_pushstring(L, ar.short_src);
+		else if (ar.name)
+			lua_pushfstring(L, "%s@%s:%d", ar.name, ar.short_src, ar.linedefined);
+		else
+			lua_pushfstring(L, "%s:%d", ar.short_src, ar.linedefined);
+	}
+	
+	/** Pushes Class:method if the function at the given stack index is found
+	 in the method tables of its first argument's class or its superclasses.
+	 The outermost class defining the function is named. */
+	static bool method(lua_State * L, lua_Debug * ar, int function)
+	{
+		int top = lua_gettop(L);
+		lua_pushnil(L);
+		if (!lua_getlocal(L, ar, 1)) {
+			lua_settop(L, top);
+			return false;
+		}
+		
+		//Find the method table of the argument, which is either a class itself
+		//or an instance of one.
+		if (lua_istable(L, top + 2)) {
+			lua_pushliteral(L, "__methods");
+			lua_rawget(L, top + 2);
+		} else {
+			lua_pushnil(L);
+		}
+		if (!lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			if (lua_getmetatable(L, top + 2)) {
+				lua_pushliteral(L, "__methods");
+				lua_rawget(L, -2);
+				lua_remove(L, -2);
+			} else {
+				lua_pushnil(L);
+			}
+		}
+		
+		//Walk up the method tables of the superclasses.
+		int methods = top + 3;
+		for (int i = 0; i < MAX_DEPTH && lua_istable(L, methods); i++) {
+			for (lua_pushnil(L); lua_next(L, methods); lua_pop(L, 1)) {
+				if (lua_type(L, -2) == LUA_TSTRING && lua_rawequal(L, -1, function)) {
+					lua_pushliteral(L, "__class");
+					lua_rawget(L, methods);
+					if (lua_isstring(L, -1)) {
+						lua_pushliteral(L, ":");
+						lua_pushvalue(L, -4);
+						lua_concat(L, 3);
+						lua_replace(L, top + 1);
+					} else {
+						lua_pop(L, 1);
+					}
+					lua_pop(L, 2);
+					break;
+				}
+			}
+			if (!lua_getmetatable(L, methods))
+				break;
+			lua_pushliteral(L, "__index");
+			lua_rawget(L, -2);
+			lua_replace(L, methods);
+			lua_pop(L, 1);
+		}
+		
+		lua_settop(L, top + 1);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			return false;
+		}
+		return true;
+	}
+};
@@ -0,0 +1,438 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "error.h"
+#include "lua.h"
+#include "object.h"
+#include "value.h"
+
+
+/** Runs methods of exposed objects as coroutines, which may wait for some
+ time or for an event without costing anything while they wait. Scripts wait
+ by calling wait with a number of seconds or waitFor with the name of an
+ event, which yield the coroutine:
+ 
+ @code
+ function Guard:patrol(distance)
+	 while true do
+		 self:walk(distance)
+		 wait(2.5)
+		 waitFor("alarm")
+	 end
+ end
+ @endcode
+ 
+ Waiting coroutines are kept in a hierarchical timer wheel with four levels
+ of 64 slots, counted in ticks of a fixed length. Advancing the scheduler
+ only visits the slots of the ticks that passed, and moves the coroutines of
+ a higher level down once per revolution of the level below, so coroutines
+ waiting for a long time are touched a few times at most. The coroutines that
+ are due are resumed in one batch per update, in the order they became due.
+ Coroutines waiting for an event are only resumed by a signal.
+ 
+ A coroutine is bound to the instance of the object it was started on. It is
+ dropped instead of resumed once that object has been deleted. The scheduler
+ must not outlive the Lua state. */
+class LuaScheduler {
+public:
+	/** Identifies a coroutine started by the scheduler. */
+	typedef uint64_t Handle;
+	
+	/** Counters of the coroutines of a scheduler. */
+	struct Stats {
+		/** Coroutines that have not finished yet. */
+		size_t running;
+		/** Coroutines waiting for an event. */
+		size_t waitingForEvents;
+		/** Resumptions so far, including the start of coroutines. */
+		size_t resumed;
+	};
+	
+	/** Creates a scheduler counting time in ticks of the given length in
+	 seconds. Waits are rounded up to whole ticks. Registers wait and waitFor
+	 in the state. */
+	LuaScheduler(lua_State * L, double tickLength = 0.001)
+	: L(L), tickLength(tickLength), time(0), now(0), updating(false), running(0), resumed(0)
+	{
+		lua_newtable(L);
+		table = luaL_ref(L, LUA_REGISTRYINDEX);
+		install(L);
+	}
+	
+	/** Drops all coroutines. */
+	~LuaScheduler()
+	{
+		luaL_unref(L, LUA_REGISTRYINDEX, table);
+	}
+	
+	/** Registers the wait and waitFor functions in the given state, which are
+	 available to coroutines run by any scheduler. */
+	static void install(lua_State * L)
+	{
+		lua_register(L, "wait", lua_wait);
+		lua_register(L, "waitFor", lua_waitFor);
+	}
+	
+	/** Starts the method with the given name of the object as a coroutine and
+	 runs it until it first waits. The arguments are passed to the method after
+	 self. Returns 0 if the object has no such method or the coroutine is done
+	 already, or the handle of the coroutine otherwise. */
+	template <typename Object, typename... Args>
+	Handle start(Object * object, const char * method, Args &&... args)
+	{
+		lua_State * co = lua_newthread(L);
+		object->loadReference();
+		if (!lua_istable(L, -1) && !lua_isuserdata(L, -1)) {
+			lua_pop(L, 2);
+			return 0;
+		}
+		lua_getfield(L, -1, method);
+		if (!lua_isfunction(L, -1)) {
+			lua_pop(L, 3);
+			return 0;
+		}
+		
+		//Move the method, self and the arguments over to the coroutine, and
+		//keep the coroutine and the instance in the scheduler's table.
+		lua_insert(L, -2);
+		lua_pushvalue(L, -1);
+		lua_insert(L, -4);
+		(LuaValue<typename std::decay<Args>::type>::push(L, args), ...);
+		lua_xmove(L, co, (int)sizeof...(Args) + 2);
+		
+		uint32_t index = allocate();
+		lua_rawgeti(L, LUA_REGISTRYINDEX, table);
+		lua_insert(L, -3);
+		behaviours[index].thread = luaL_ref(L, -3);
+		behaviours[index].instance = luaL_ref(L, -2);
+		lua_pop(L, 1);
+		running++;
+		
+		Handle handle = makeHandle(index);
+		resume(index, (int)sizeof...(Args) + 1);
+		return (isAlive(handle) ? handle : 0);
+	}
+	
+	/** Returns whether the coroutine with the given handle has not finished
+	 yet. */
+	bool isAlive(Handle handle) const
+	{
+		uint32_t index = (uint32_t)handle;
+		return (index < behaviours.size() && behaviours[index].thread != LUA_NOREF &&
+				behaviours[index].generation == (uint32_t)(handle >> 32));
+	}
+	
+	/** Drops the coroutine with the given handle without resuming it. */
+	void stop(Handle handle)
+	{
+		if (isAlive(handle))
+			release((uint32_t)handle);
+	}
+	
+	/** Advances the time by the given number of seconds and resumes the
+	 coroutines that are due, followed by those waiting for the events
+	 signalled meanwhile. */
+	void update(double seconds)
+	{
+		time += seconds;
+		uint64_t target = (uint64_t)std::floor(time / tickLength);
+		updating = true;
+		while (now < target)
+			advance();
+		
+		//Resume the coroutines that are due. Coroutines which wait for less
+		//than a tick are scheduled for the next tick, so the batch ends.
+		for (size_t i = 0; i < ready.size(); i++) {
+			Entry e = ready[i];
+			if (current(e))
+				resume(e.index, 0);
+		}
+		ready.clear();
+		
+		//Signals raised while resuming may wake further coroutines.
+		while (!signals.empty()) {
+			std::vector<std::string> pending;
+			pending.swap(signals);
+			for (size_t i = 0; i < pending.size(); i++)
+				wake(pending[i]);
+		}
+		updating = false;
+	}
+	
+	/** Resumes the coroutines waiting for the given event. Signals raised
+	 during an update are handled at its end. */
+	void signal(const char * event)
+	{
+		if (updating) {
+			signals.push_back(event);
+			return;
+		}
+		updating = true;
+		wake(event);
+		while (!signals.empty()) {
+			std::vector<std::string> pending;
+			pending.swap(signals);
+			for (size_t i = 0; i < pending.size(); i++)
+				wake(pending[i]);
+		}
+		updating = false;
+	}
+	
+	/** Returns the counters of the coroutines. */
+	Stats getStats() const
+	{
+		Stats s;
+		s.running = running;
+		s.waitingForEvents = 0;
+		for (Events::const_iterator it = events.begin(); it != events.end(); ++it)
+			for (size_t i = 0; i < it->second.size(); i++)
+				if (current(it->second[i]))
+					s.waitingForEvents++;
+		s.resumed = resumed;
+		return s;
+	}
+	
+private:
+	/** Number of levels of the timer wheel and of slots per level. */
+	static const int LEVELS = 4;
+	static const int BITS = 6;
+	static const int SLOTS = 1 << BITS;
+	
+	/** A coroutine and what it waits for. */
+	struct Behaviour {
+		/** References to the coroutine and the instance in the scheduler's
+		 table, LUA_NOREF if the slot is free. */
+		int thread;
+		int instance;
+		/** Incremented whenever the coroutine is resumed or dropped, which
+		 invalidates the entries referring to it. */
+		uint32_t wake;
+		/** Incremented whenever the slot is reused, which invalidates the
+		 handles referring to it. */
+		uint32_t generation;
+		/** Tick at which the coroutine is due. */
+		uint64_t due;
+	};
+	
+	/** Entry of the timer wheel or of the list of an event. */
+	struct Entry {
+		uint32_t index;
+		uint32_t wake;
+	};
+	
+	typedef std::unordered_map<std::string, std::vector<Entry> > Events;
+	
+	lua_State * L;
+	/** Registry reference to the table holding the coroutines and their
+	 instances. */
+	int table;
+	double tickLength;
+	double time;
+	/** Current tick. */
+	uint64_t now;
+	bool updating;
+	size_t running;
+	size_t resumed;
+	std::vector<Behaviour> behaviours;
+	std::vector<uint32_t> unused;
+	std::vector<Entry> wheel[LEVELS][SLOTS];
+	/** Coroutines due in the current update. */
+	std::vector<Entry> ready;
+	Events events;
+	std::vector<std::string> signals;
+	
+	LuaScheduler(const LuaScheduler &);
+	LuaScheduler & operator=(const LuaScheduler &);
+	
+	Handle makeHandle(uint32_t index) const
+	{
+		return ((Handle)behaviours[index].generation << 32) | index;
+	}
+	
+	bool current(const Entry & e) const
+	{
+		return (behaviours[e.index].thread != LUA_NOREF && behaviours[e.index].wake == e.wake);
+	}
+	
+	uint32_t allocate()
+	{
+		uint32_t index;
+		if (!unused.empty()) {
+			index = unused.back();
+			unused.pop_back();
+		} else {
+			index = (uint32_t)behaviours.size();
+			Behaviour b = {LUA_NOREF, LUA_NOREF, 0, 1, 0};
+			behaviours.push_back(b);
+		}
+		return index;
+	}
+	
+	/** Drops the coroutine in the given slot. */
+	void release(uint32_t index)
+	{
+		Behaviour & b = behaviours[index];
+		lua_rawgeti(L, LUA_REGISTRYINDEX, table);
+		luaL_unref(L, -1, b.thread);
+		luaL_unref(L, -1, b.instance);
+		lua_pop(L, 1);
+		b.thread = LUA_NOREF;
+		b.instance = LUA_NOREF;
+		b.wake++;
+		b.generation++;
+		unused.push_back(index);
+		running--;
+	}
+	
+	/** Puts the coroutine in the given slot into the timer wheel at its due
+	 tick, on the lowest level whose range covers the remaining time. */
+	void schedule(uint32_t index)
+	{
+		const Behaviour & b = behaviours[index];
+		Entry e = {index, b.wake};
+		if (b.due <= now) {
+			ready.push_back(e);
+			return;
+		}
+		uint64_t delta = b.due - now;
+		int level = 0;
+		while (level < LEVELS - 1 && delta >= ((uint64_t)1 << (BITS * (level + 1))))
+			level++;
+		
+		//Waits beyond the range of the wheel are parked in the slot of the top
+		//level visited last, and rescheduled from there.
+		uint64_t at = b.due;
+		if (delta >= ((uint64_t)1 << (BITS * LEVELS)))
+			at = now + ((uint64_t)1 << (BITS * LEVELS)) - 1;
+		wheel[level][(at >> (BITS * level)) & (SLOTS - 1)].push_back(e);
+	}
+	
+	/** Advances the wheel by one tick, moving the coroutines that are due
+	 into the ready list. */
+	void advance()
+	{
+		now++;
+		
+		//Move the slots of the higher levels whose turn has come down to the
+		//lower levels, starting at the top so a slot moved down is moved
+		//further if its turn has come as well.
+		for (int level = LEVELS - 1; level > 0; level--) {
+			if (now & (((uint64_t)1 << (BITS * level)) - 1))
+				continue;
+			std::vector<Entry> & slot = wheel[level][(now >> (BITS * level)) & (SLOTS - 1)];
+			if (slot.empty())
+				continue;
+			std::vector<Entry> entries;
+			entries.swap(slot);
+			for (size_t i = 0; i < entries.size(); i++)
+				if (current(entries[i]))
+					schedule(entries[i].index);
+		}
+		
+		std::vector<Entry> & slot = wheel[0][now & (SLOTS - 1)];
+		for (size_t i = 0; i < slot.size(); i++)
+			if (current(slot[i]))
+				ready.push_back(slot[i]);
+		slot.clear();
+	}
+	
+	/** Resumes the coroutines waiting for the given event. */
+	void wake(const std::string & event)
+	{
+		Events::iterator it = events.find(event);
+		if (it == events.end())
+			return;
+		std::vector<Entry> entries;
+		entries.swap(it->second);
+		events.erase(it);
+		for (size_t i = 0; i < entries.size(); i++)
+			if (current(entries[i]))
+				resume(entries[i].index, 0);
+	}
+	
+	/** Resumes the coroutine in the given slot with the given number of
+	 arguments on its stack and schedules it according to what it yielded.
+	 Coroutines whose object has been deleted are dropped instead. */
+	void resume(uint32_t index, int argc)
+	{
+		//The coroutine stays on the stack while it runs, so it is kept alive
+		//even if it stops itself.
+		Behaviour & b = behaviours[index];
+		b.wake++;
+		uint32_t generation = b.generation;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, table);
+		lua_rawgeti(L, -1, b.instance);
+		bool alive = isObject(L, -1);
+		lua_rawgeti(L, -2, b.thread);
+		lua_State * co = lua_tothread(L, -1);
+		lua_replace(L, -3);
+		lua_pop(L, 1);
+		if (!alive) {
+			lua_pop(L, 1);
+			release(index);
+			return;
+		}
+		
+		resumed++;
+		int status = lua_resume(co, argc);
+		
+		//The behaviours may have grown or the coroutine may have been stopped
+		//while it ran.
+		Behaviour & r = behaviours[index];
+		if (r.generation != generation) {
+			lua_settop(co, 0);
+		} else if (status != LUA_YIELD) {
+			if (status != 0)
+				LuaError::report(co);
+			release(index);
+		} else if (lua_isstring(co, 1) && !lua_isnumber(co, 1)) {
+			//Wait for the event that was yielded.
+			Entry e = {index, r.wake};
+			events[lua_tostring(co, 1)].push_back(e);
+			lua_settop(co, 0);
+		} else {
+			//Wait for the number of seconds that was yielded, or until the
+			//next tick.
+			double seconds = (lua_isnumber(co, 1) ? lua_tonumber(co, 1) : 0);
+			uint64_t ticks = (uint64_t)std::ceil(seconds / tickLength);
+			r.due = now + (ticks ? ticks : 1);
+			schedule(index);
+			lua_settop(co, 0);
+		}
+		lua_pop(L, 1);
+	}
+	
+	/** Returns whether the instance at the given index still leads to its
+	 object. */
+	static bool isObject(lua_State * L, int index)
+	{
+		LuaObject::Data * data = LuaObject::toData(L, index);
+		if (!data && lua_istable(L, index)) {
+			lua_getfield(L, index, "__this");
+			data = (LuaObject::Data *)lua_touserdata(L, -1);
+			lua_pop(L, 1);
+		}
+		return (data && data->object);
+	}
+	
+	/** Waits for the given number of seconds, or until the next tick. */
+	static int lua_wait(lua_State * L)
+	{
+		lua_Number seconds = luaL_optnumber(L, 1, 0);
+		lua_settop(L, 0);
+		lua_pushnumber(L, seconds);
+		return lua_yield(L, 1);
+	}
+	
+	/** Waits until the event with the given name is signalled. */
+	static int lua_waitFor(lua_State * L)
+	{
+		luaL_checkstring(L, 1);
+		lua_settop(L, 1);
+		return lua_yield(L, 1);
+	}
+};
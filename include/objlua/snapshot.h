@@ -0,0 +1,721 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "error.h"
+#include "lua.h"
+#include "object.h"
+
+
+/** Compact binary snapshot of Lua values, which may be restored later, e.g. to
+ checkpoint the state of scripts for failover. The encoding is modelled after
+ MessagePack.
+ 
+ Nested tables are encoded along with their contents. A table that occurs
+ several times, including a table that contains itself, is encoded once and
+ referred to afterwards, so shared and cyclic structures are restored as
+ such. The metatables of plain tables are not part of the snapshot.
+ 
+ Instances of classes, i.e. tables and userdata whose metatable carries a
+ __class name, are encoded as their class name plus their fields, including
+ the writable properties of exposed objects. Instances of exposed classes are
+ restored by calling Class:new(), which creates the C++ object and runs the
+ constructor through constructLua, and then assigning the fields. Other in-
+ stances are restored by setting the class as the metatable of their fields.
+ 
+ Functions, threads and userdata which are no instances cannot be encoded.
+ Table entries holding them are left out, or stored as nil in the array part
+ of a table.
+ 
+ @code
+ lua_getglobal(L, "world");
+ LuaSnapshot::save(L, -1, "world.snapshot");
+ ...
+ if (LuaSnapshot::load(L, "world.snapshot"))
+	 lua_setglobal(L, "world");
+ @endcode */
+class LuaSnapshot {
+public:
+	/** Appends the encoded value at the given index to the string. Returns
+	 false if the value cannot be encoded. */
+	static bool encode(lua_State * L, int index, std::string & out)
+	{
+		if (index < 0)
+			index += lua_gettop(L) + 1;
+		Encoder e(L, out);
+		out.append(MAGIC, 4);
+		out.push_back(VERSION);
+		return e.value(index, true);
+	}
+	
+	/** Decodes the given buffer and pushes the value. Returns false and pushes
+	 nothing if the buffer holds no valid snapshot. */
+	static bool decode(lua_State * L, const char * data, size_t size)
+	{
+		if (size < 5 || memcmp(data, MAGIC, 4) != 0 || data[4] != VERSION) {
+			std::cerr << "objlua: *** Unable to decode snapshot, invalid header.\n";
+			return false;
+		}
+		int top = lua_gettop(L);
+		lua_newtable(L);
+		Decoder d(L, top + 1, (const unsigned char *)data + 5, (const unsigned char *)data + size);
+		if (!d.value() || d.p != d.end) {
+			std::cerr << "objlua: *** Unable to decode snapshot, data is malformed.\n";
+			lua_settop(L, top);
+			return false;
+		}
+		lua_remove(L, top + 1);
+		return true;
+	}
+	
+	/** Writes the encoded value at the given index to a file. The file is
+	 replaced atomically, so an interrupted save leaves the previous snapshot
+	 intact. */
+	static bool save(lua_State * L, int index, const char * path)
+	{
+		std::string data;
+		if (!encode(L, index, data))
+			return false;
+		
+		std::string temp = std::string(path) + ".tmp";
+		FILE * f = fopen(temp.c_str(), "wb");
+		if (!f) {
+			std::cerr << "objlua: *** Unable to write snapshot " << path << ".\n";
+			return false;
+		}
+		bool ok = (fwrite(data.data(), 1, data.size(), f) == data.size());
+		ok = (fclose(f) == 0 && ok);
+		if (!ok || rename(temp.c_str(), path) != 0) {
+			unlink(temp.c_str());
+			std::cerr << "objlua: *** Unable to write snapshot " << path << ".\n";
+			return false;
+		}
+		return true;
+	}
+	
+	/** Decodes the snapshot in the given file, which is mapped into memory,
+	 and pushes the value. Returns false and pushes nothing on failure. */
+	static bool load(lua_State * L, const char * path)
+	{
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			std::cerr << "objlua: *** Unable to read snapshot " << path << ".\n";
+			return false;
+		}
+		struct stat info;
+		void * data = MAP_FAILED;
+		size_t size = 0;
+		if (fstat(fd, &info) == 0 && info.st_size > 0) {
+			size = (size_t)info.st_size;
+			data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		close(fd);
+		if (data == MAP_FAILED) {
+			std::cerr << "objlua: *** Unable to read snapshot " << path << ".\n";
+			return false;
+		}
+		bool result = decode(L, (const char *)data, size);
+		munmap(data, size);
+		return result;
+	}
+	
+private:
+	static constexpr const char * MAGIC = "OLSN";
+	static const char VERSION = 1;
+	/** Deepest nesting of tables that is encoded or decoded. */
+	static const int MAX_DEPTH = 200;
+	
+	/** Type tags. Small integers, strings, arrays and maps are packed into the
+	 tag itself as in MessagePack. */
+	enum {
+		FIXMAP = 0x80,
+		FIXARRAY = 0x90,
+		FIXSTR = 0xa0,
+		NIL = 0xc0,
+		REF = 0xc1,
+		FALSE = 0xc2,
+		TRUE = 0xc3,
+		INSTANCE = 0xc7,
+		FLOAT64 = 0xcb,
+		INT32 = 0xd2,
+		STR8 = 0xd9,
+		STR16 = 0xda,
+		STR32 = 0xdb,
+		TABLE = 0xdf,
+		NEGATIVE_FIXINT = 0xe0
+	};
+	
+	/** Kinds of instances. */
+	enum {
+		PLAIN_INSTANCE = 0,
+		EXPOSED_INSTANCE = 1
+	};
+	
+	class Encoder {
+	public:
+		Encoder(lua_State * L, std::string & out) : L(L), out(out), depth(0) {}
+		
+		/** Encodes the value at the given index. Values that cannot be encoded
+		 are stored as nil unless required is set, in which case encoding
+		 fails. */
+		bool value(int index, bool required = false)
+		{
+			if (index < 0)
+				index += lua_gettop(L) + 1;
+			switch (lua_type(L, index)) {
+				case LUA_TNIL: byte(NIL); return true;
+				case LUA_TBOOLEAN: byte(lua_toboolean(L, index) ? TRUE : FALSE); return true;
+				case LUA_TNUMBER: number(lua_tonumber(L, index)); return true;
+				case LUA_TSTRING: {
+					size_t length;
+					const char * s = lua_tolstring(L, index, &length);
+					string(s, length);
+				} return true;
+				case LUA_TTABLE:
+				case LUA_TUSERDATA:
+					if (encodable(index))
+						return reference(index);
+					break;
+			}
+			if (required) {
+				std::cerr << "objlua: *** Unable to encode snapshot, "
+				<< lua_typename(L, lua_type(L, index)) << " cannot be encoded.\n";
+				return false;
+			}
+			byte(NIL);
+			return true;
+		}
+	
+	private:
+		lua_State * L;
+		std::string & out;
+		int depth;
+		/** Identifiers of the tables and instances encoded so far, in the order
+		 they were encountered. */
+		std::unordered_map<const void *, uint32_t> refs;
+		
+		void byte(int b) { out.push_back((char)b); }
+		void u16(uint32_t v) { byte(v >> 8); byte(v); }
+		void u32(uint32_t v) { byte(v >> 24); byte(v >> 16); byte(v >> 8); byte(v); }
+		
+		void number(lua_Number n)
+		{
+			if (n >= INT32_MIN && n <= INT32_MAX && n == (lua_Number)(int32_t)n) {
+				int32_t i = (int32_t)n;
+				if (i >= 0 && i < 0x80)
+					byte(i);
+				else if (i < 0 && i >= -32)
+					byte(i & 0xff);
+				else {
+					byte(INT32);
+					u32((uint32_t)i);
+				}
+				return;
+			}
+			double d = (double)n;
+			uint64_t bits;
+			memcpy(&bits, &d, sizeof(bits));
+			byte(FLOAT64);
+			u32((uint32_t)(bits >> 32));
+			u32((uint32_t)bits);
+		}
+		
+		void string(const char * s, size_t length)
+		{
+			if (length < 32)
+				byte(FIXSTR | (int)length);
+			else if (length <= 0xff) {
+				byte(STR8);
+				byte((int)length);
+			} else if (length <= 0xffff) {
+				byte(STR16);
+				u16((uint32_t)length);
+			} else {
+				byte(STR32);
+				u32((uint32_t)length);
+			}
+			out.append(s, length);
+		}
+		
+		/** Returns whether the table or userdata at the given index can be
+		 encoded. */
+		bool encodable(int index)
+		{
+			if (lua_istable(L, index))
+				return true;
+			LuaObject::Data * data = LuaObject::toData(L, index);
+			if (!data || !data->object)
+				return false;
+			return pushClassName(index);
+		}
+		
+		/** Pushes the class name of the instance at the given index and returns
+		 true, or returns false if the value is no instance. */
+		bool pushClassName(int index)
+		{
+			if (!lua_getmetatable(L, index))
+				return false;
+			lua_pushliteral(L, "__class");
+			lua_rawget(L, -2);
+			lua_remove(L, -2);
+			if (lua_type(L, -1) == LUA_TSTRING)
+				return true;
+			lua_pop(L, 1);
+			return false;
+		}
+		
+		/** Returns whether the table instance at the given index holds an
+		 exposed object. */
+		bool exposed(int index)
+		{
+			lua_pushliteral(L, "__this");
+			lua_rawget(L, index);
+			LuaObject::Data * data = LuaObject::toData(L, -1);
+			lua_pop(L, 1);
+			return (data != NULL);
+		}
+		
+		/** Returns whether the property on top of the stack can be restored,
+		 i.e. is not read-only. */
+		bool writable()
+		{
+			const LuaObject::Property * property = (const LuaObject::Property *)lua_touserdata(L, -1);
+			return (property && property->set);
+		}
+		
+		/** Returns the object of the exposed instance at the given index, or
+		 NULL if it has been deleted. */
+		void * toObject(int index)
+		{
+			LuaObject::Data * data;
+			if (lua_type(L, index) == LUA_TUSERDATA) {
+				data = LuaObject::toData(L, index);
+			} else {
+				lua_pushliteral(L, "__this");
+				lua_rawget(L, index);
+				data = LuaObject::toData(L, -1);
+				lua_pop(L, 1);
+			}
+			return (data ? data->object : NULL);
+		}
+		
+		/** Encodes a table or instance, or a reference to it if it has been
+		 encoded before. */
+		bool reference(int index)
+		{
+			const void * p = lua_topointer(L, index);
+			std::unordered_map<const void *, uint32_t>::iterator it = refs.find(p);
+			if (it != refs.end()) {
+				if (lua_type(L, index) == LUA_TUSERDATA)
+					lua_pop(L, 1);
+				byte(REF);
+				u32(it->second);
+				return true;
+			}
+			if (depth >= MAX_DEPTH || !lua_checkstack(L, 6)) {
+				std::cerr << "objlua: *** Unable to encode snapshot, tables are"
+				" nested too deeply.\n";
+				return false;
+			}
+			uint32_t id = (uint32_t)refs.size();
+			refs[p] = id;
+			depth++;
+			bool result;
+			if (lua_type(L, index) == LUA_TUSERDATA)
+				result = userdata(index);
+			else if (pushClassName(index))
+				result = instance(index, exposed(index) ? EXPOSED_INSTANCE : PLAIN_INSTANCE, index, "__this");
+			else
+				result = table(index);
+			depth--;
+			return result;
+		}
+		
+		/** Encodes the userdata instance at the given index, whose class name
+		 is on top of the stack. */
+		bool userdata(int index)
+		{
+			//Fields live in the environment table, unless none were assigned
+			//yet and it is still the method table.
+			lua_getfenv(L, index);
+			lua_getmetatable(L, index);
+			lua_pushliteral(L, "__methods");
+			lua_rawget(L, -2);
+			bool fields = (lua_istable(L, -3) && !lua_rawequal(L, -1, -3));
+			lua_pop(L, 2);
+			if (!fields) {
+				lua_pop(L, 1);
+				lua_newtable(L);
+			}
+			return instance(index, EXPOSED_INSTANCE, lua_gettop(L), NULL);
+		}
+		
+		/** Encodes an instance whose class name is below the table holding its
+		 fields on top of the stack, or on top of the stack if the fields are
+		 the instance itself. Pops the stack items. The field with the given
+		 name is skipped. */
+		bool instance(int index, int kind, int fields, const char * skip)
+		{
+			int top = lua_gettop(L);
+			int name = (fields == index ? top : top - 1);
+			byte(INSTANCE);
+			byte(kind);
+			value(name);
+			
+			//Properties of exposed objects are read from the object and
+			//encoded like fields.
+			void * object = NULL;
+			int properties = 0;
+			if (kind == EXPOSED_INSTANCE && (object = toObject(index)) && lua_getmetatable(L, index)) {
+				lua_pushliteral(L, "__properties");
+				lua_rawget(L, -2);
+				lua_remove(L, -2);
+				properties = lua_gettop(L);
+			}
+			
+			//Count the fields first, as the count precedes them.
+			uint32_t count = 0;
+			for (lua_pushnil(L); lua_next(L, fields); lua_pop(L, 1))
+				if (entry(skip))
+					count++;
+			if (properties && lua_istable(L, properties))
+				for (lua_pushnil(L); lua_next(L, properties); lua_pop(L, 1))
+					count += (writable() ? 1 : 0);
+			else
+				properties = 0;
+			u32(count);
+			
+			bool result = true;
+			for (lua_pushnil(L); result && lua_next(L, fields); lua_pop(L, 1))
+				if (entry(skip))
+					result = (value(-2) && value(-1));
+			for (lua_pushnil(L); result && properties && lua_next(L, properties); lua_pop(L, 1)) {
+				if (!writable())
+					continue;
+				const LuaObject::Property * property = (const LuaObject::Property *)lua_touserdata(L, -1);
+				property->get(L, object);
+				result = (value(-3) && value(-1));
+				lua_pop(L, 1);
+			}
+			lua_settop(L, name - 1);
+			return result;
+		}
+		
+		/** Encodes the plain table at the given index. Consecutive integer keys
+		 from 1 onwards make up the array part. */
+		bool table(int index)
+		{
+			uint32_t narr = 0;
+			for (;;) {
+				lua_rawgeti(L, index, narr + 1);
+				bool present = !lua_isnil(L, -1);
+				lua_pop(L, 1);
+				if (!present)
+					break;
+				narr++;
+			}
+			uint32_t nrec = 0;
+			for (lua_pushnil(L); lua_next(L, index); lua_pop(L, 1))
+				if (!inArray(narr) && entry(NULL))
+					nrec++;
+			
+			if (nrec == 0 && narr < 16)
+				byte(FIXARRAY | (int)narr);
+			else if (narr == 0 && nrec < 16)
+				byte(FIXMAP | (int)nrec);
+			else {
+				byte(TABLE);
+				u32(narr);
+				u32(nrec);
+			}
+			
+			for (uint32_t i = 1; i <= narr; i++) {
+				lua_rawgeti(L, index, i);
+				bool result = value(-1);
+				lua_pop(L, 1);
+				if (!result)
+					return false;
+			}
+			for (lua_pushnil(L); lua_next(L, index); lua_pop(L, 1)) {
+				if (!inArray(narr) && entry(NULL) && (!value(-2) || !value(-1))) {
+					lua_pop(L, 2);
+					return false;
+				}
+			}
+			return true;
+		}
+		
+		/** Returns whether the key on the stack below the value is part of the
+		 array part of the given length. */
+		bool inArray(uint32_t narr)
+		{
+			if (lua_type(L, -2) != LUA_TNUMBER)
+				return false;
+			lua_Number n = lua_tonumber(L, -2);
+			return (n >= 1 && n <= narr && n == (lua_Number)(uint32_t)n);
+		}
+		
+		/** Returns whether the key and value on top of the stack make up an
+		 entry that is encoded. */
+		bool entry(const char * skip)
+		{
+			if (skip && lua_type(L, -2) == LUA_TSTRING && strcmp(lua_tostring(L, -2), skip) == 0)
+				return false;
+			return (storable(-2) && storable(-1));
+		}
+		
+		/** Returns whether the value at the given index can be encoded. */
+		bool storable(int index)
+		{
+			int type = lua_type(L, index);
+			if (type == LUA_TUSERDATA) {
+				if (!encodable(index))
+					return false;
+				lua_pop(L, 1);
+				return true;
+			}
+			return (type != LUA_TFUNCTION && type != LUA_TTHREAD &&
+					type != LUA_TLIGHTUSERDATA && type != LUA_TNONE);
+		}
+	};
+	
+	class Decoder {
+	public:
+		Decoder(lua_State * L, int refs, const unsigned char * p, const unsigned char * end)
+		: p(p), end(end), L(L), refs(refs), count(0), depth(0) {}
+		
+		const unsigned char * p;
+		const unsigned char * end;
+		
+		/** Decodes a value and pushes it. Returns false and pushes nothing if
+		 the data is malformed. */
+		bool value()
+		{
+			if (p >= end)
+				return false;
+			int tag = *p++;
+			if (tag < FIXMAP) {
+				lua_pushinteger(L, tag);
+				return true;
+			}
+			if (tag >= NEGATIVE_FIXINT) {
+				lua_pushinteger(L, tag - 0x100);
+				return true;
+			}
+			if (tag < FIXARRAY)
+				return table(0, tag & 0x0f);
+			if (tag < FIXSTR)
+				return table(tag & 0x0f, 0);
+			if (tag < NIL)
+				return string(tag & 0x1f);
+			
+			uint32_t a, b;
+			switch (tag) {
+				case NIL: lua_pushnil(L); return true;
+				case FALSE: lua_pushboolean(L, 0); return true;
+				case TRUE: lua_pushboolean(L, 1); return true;
+				case INT32:
+					if (!u32(a))
+						return false;
+					lua_pushnumber(L, (lua_Number)(int32_t)a);
+					return true;
+				case FLOAT64: {
+					if (!u32(a) || !u32(b))
+						return false;
+					uint64_t bits = ((uint64_t)a << 32) | b;
+					double d;
+					memcpy(&d, &bits, sizeof(d));
+					lua_pushnumber(L, (lua_Number)d);
+				} return true;
+				case STR8:
+					if (end - p < 1)
+						return false;
+					return string(*p++);
+				case STR16:
+					if (end - p < 2)
+						return false;
+					a = ((uint32_t)p[0] << 8) | p[1];
+					p += 2;
+					return string(a);
+				case STR32: return (u32(a) && string(a));
+				case TABLE: return (u32(a) && u32(b) && table(a, b));
+				case REF:
+					if (!u32(a) || a >= count)
+						return false;
+					lua_rawgeti(L, refs, (int)a + 1);
+					return true;
+				case INSTANCE: return instance();
+			}
+			return false;
+		}
+	
+	private:
+		lua_State * L;
+		/** Stack index of the table of decoded tables and instances. */
+		int refs;
+		/** Number of decoded tables and instances. */
+		uint32_t count;
+		int depth;
+		
+		bool u32(uint32_t & v)
+		{
+			if (end - p < 4)
+				return false;
+			v = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+			p += 4;
+			return true;
+		}
+		
+		/** Pushes a string of the given length straight from the buffer. */
+		bool string(uint32_t length)
+		{
+			if ((size_t)(end - p) < length)
+				return false;
+			lua_pushlstring(L, (const char *)p, length);
+			p += length;
+			return true;
+		}
+		
+		/** Records the table or instance on top of the stack, so later refer-
+		 ences resolve to it. */
+		bool enter()
+		{
+			if (depth >= MAX_DEPTH || !lua_checkstack(L, 6))
+				return false;
+			depth++;
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, refs, (int)++count);
+			return true;
+		}
+		
+		/** Decodes the given number of key-value pairs into the table or in-
+		 stance on top of the stack. Pairs are assigned raw unless the target
+		 is an instance of an exposed class, in which case they are assigned in
+		 a protected call, since property setters raise errors for values of
+		 the wrong type. */
+		bool pairs(uint32_t n, bool raw)
+		{
+			//Each pair takes at least two bytes, which also bounds the loop for
+			//malformed counts.
+			if ((size_t)(end - p) < (size_t)n * 2)
+				return false;
+			for (uint32_t i = 0; i < n; i++) {
+				if (!value())
+					return false;
+				if (!value()) {
+					lua_pop(L, 1);
+					return false;
+				}
+				if (lua_isnil(L, -2) || (lua_type(L, -2) == LUA_TNUMBER && lua_tonumber(L, -2) != lua_tonumber(L, -2))) {
+					lua_pop(L, 2);
+					return false;
+				}
+				if (raw) {
+					lua_rawset(L, -3);
+					continue;
+				}
+				lua_pushcfunction(L, lua_assign);
+				lua_pushvalue(L, -4);
+				lua_pushvalue(L, -4);
+				lua_pushvalue(L, -4);
+				int error = lua_pcall(L, 3, 0, 0);
+				if (error)
+					LuaError::report(L);
+				lua_pop(L, 2);
+				if (error)
+					return false;
+			}
+			return true;
+		}
+		
+		/** Assigns the value at index 3 to the key at index 2 of the instance
+		 at index 1. */
+		static int lua_assign(lua_State * L)
+		{
+			lua_settable(L, 1);
+			return 0;
+		}
+		
+		bool table(uint32_t narr, uint32_t nrec)
+		{
+			if ((size_t)(end - p) < (size_t)narr + (size_t)nrec * 2)
+				return false;
+			lua_createtable(L, (int)narr, (int)nrec);
+			if (!enter()) {
+				lua_pop(L, 1);
+				return false;
+			}
+			bool result = true;
+			for (uint32_t i = 1; result && i <= narr; i++) {
+				result = value();
+				if (result)
+					lua_rawseti(L, -2, (int)i);
+			}
+			result = (result && pairs(nrec, true));
+			depth--;
+			if (!result)
+				lua_pop(L, 1);
+			return result;
+		}
+		
+		bool instance()
+		{
+			if (end - p < 1)
+				return false;
+			int kind = *p++;
+			uint32_t n;
+			if (!value())
+				return false;
+			if (lua_type(L, -1) != LUA_TSTRING || !u32(n)) {
+				lua_pop(L, 1);
+				return false;
+			}
+			
+			//Create the instance through its class.
+			int name = lua_gettop(L);
+			bool raw = true;
+			lua_getglobal(L, lua_tostring(L, name));
+			if (!lua_istable(L, -1)) {
+				std::cerr << "objlua: *** Unable to restore instance of unknown class "
+				<< lua_tostring(L, name) << ".\n";
+				lua_pop(L, 1);
+				lua_newtable(L);
+			} else if (kind == EXPOSED_INSTANCE) {
+				lua_getfield(L, -1, "new");
+				lua_insert(L, -2);
+				lua_getglobal(L, "stacktrace");
+				lua_insert(L, -3);
+				if (lua_pcall(L, 1, 1, -3) != 0) {
+					LuaError::report(L);
+					lua_pop(L, 1);
+					lua_newtable(L);
+				} else {
+					lua_remove(L, -2);
+					raw = false;
+				}
+			} else {
+				lua_newtable(L);
+				lua_insert(L, -2);
+				lua_setmetatable(L, -2);
+			}
+			lua_remove(L, name);
+			
+			if (!enter()) {
+				lua_pop(L, 1);
+				return false;
+			}
+			bool result = pairs(n, raw);
+			depth--;
+			if (!result)
+				lua_pop(L, 1);
+			return result;
+		}
+	};
+};
@@ -22,14 +22,11 @@ public:
 		
 		//Iterate through the stack from top to bottom and show each entry.
 		for (int i = n; i > 0; i--) {
-			//Extract the stack entry's type.
-			int type = lua_type(L, i);
-			
 			//Dump the header.
 			s << "    [" << i << "] ";
 			
 			//Dump the contents of whatever there is on the stack.
-			s << LuaDescribe::generic(L, type, i, 1);
+			LuaDescribe::write(s, L, i, LuaDescribe::Limits(), 1);
 			
 			s << "\n";
 		}
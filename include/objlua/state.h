@@ -1,39 +1,47 @@
 #pragma once
+#include "alloc.h"
+#include "bytecode.h"
+#include "embedded.h"
 #include "error.h"
 #include "lua.h"
+#include "metrics.h"
 #include "stack.h"
 
 
 class LuaState {
 public:
-    /** Constructor which initializes the state. */
-    LuaState()
+    /** Constructor which initializes the state. The state allocates its memory
+     through a LuaPoolAllocator owned by the state. */
+    LuaState() : allocator(new LuaPoolAllocator), ownsAllocator(true)
     {
-        //Open a new lua state.
-        state = lua_open();
-        if (!state) {
-            std::cerr << "objlua: *** unable to open new lua state\n";
-            return;
-        }
-        
-        //Register the basic panic fallback.
-        lua_atpanic(state, lua_panic);
-		
-		//Register helper functions.
-		lua_register(state, "dumpStack", lua_dumpStack);
-		lua_register(state, "dump", lua_dump);
-        
-        //Load the default libraries.
-        luaL_openlibs(state);
-		
-		//Reset the stack so we get a clean working area.
-		lua_settop(state, 0);
-		
-		//Register the stacktrace function which may be used as an error function for Lua errors.
-		lua_register(state, "stacktrace", stacktrace);
+        open(LuaAllocator::alloc, allocator);
+    }
+    /** Constructor which initializes the state with the given allocator. The
+     allocator has to outlive the state. */
+    LuaState(LuaAllocator & a) : allocator(&a), ownsAllocator(false)
+    {
+        open(LuaAllocator::alloc, allocator);
+    }
+    /** Constructor which initializes the state with a custom allocation
+     function. No memory statistics are available for such states. */
+    LuaState(lua_Alloc f, void * ud) : allocator(NULL), ownsAllocator(false)
+    {
+        open(f, ud);
     }
     /** Destructor which closes the state and cleans up. */
-    ~LuaState() { lua_close(state); state = NULL; }
+    ~LuaState()
+    {
+        if (state)
+            lua_close(state);
+        state = NULL;
+        if (ownsAllocator)
+            delete allocator;
+    }
+    
+    /** Returns the allocator of the state, which provides the memory statis-
+     tics and the memory limit. Returns NULL if the state was created with a
+     custom allocation function. */
+    LuaAllocator * getAllocator() { return allocator; }
     
     /** Convenience cast operator so you can use the LuaState instance as if it
      were a normal lua_State. */
@@ -42,13 +50,48 @@ public:
     /** Convenience wrapper around the objlua_reportError function. */
     void reportError() { LuaError::report(*this); }
 	
+	/** Makes dofile load scripts through the given bytecode cache, which has to
+	 outlive the state. Pass NULL to load scripts from source again. */
+	void setBytecodeCache(LuaBytecodeCache * cache)
+	{
+		lua_pushlightuserdata(state, bytecodeKey());
+		if (cache)
+			lua_pushlightuserdata(state, cache);
+		else
+			lua_pushnil(state);
+		lua_rawset(state, LUA_REGISTRYINDEX);
+	}
+	
+	/** Returns the bytecode cache scripts are loaded through, if any. */
+	LuaBytecodeCache * getBytecodeCache() { return getBytecodeCache(state); }
+	
+	/** Returns the bytecode cache scripts in the given state are loaded
+	 through, if any. */
+	static LuaBytecodeCache * getBytecodeCache(lua_State * L)
+	{
+		lua_pushlightuserdata(L, bytecodeKey());
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		LuaBytecodeCache * cache = (LuaBytecodeCache *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		return cache;
+	}
+	
 	/** Convenience wrapper around luaL_dofile which automatically reports any
-	 errors that might occur. */
-	bool dofile(const char * fn)
+	 errors that might occur. Scripts embedded into the binary are preferred
+	 over files, which are taken from the bytecode cache if the state has one. */
+	bool dofile(const char * fn) { return dofile(state, fn); }
+	
+	/** Same as dofile, for any Lua state. */
+	static bool dofile(lua_State * L, const char * fn)
 	{
-		if (luaL_dofile(state, fn)) {
-			stacktrace(state);
-			reportError();
+		int error = LuaEmbedded::load(L, fn);
+		if (error < 0) {
+			LuaBytecodeCache * cache = getBytecodeCache(L);
+			error = (cache ? cache->load(L, fn) : luaL_loadfile(L, fn));
+		}
+		if (error || lua_pcall(L, 0, LUA_MULTRET, 0)) {
+			stacktrace(L);
+			LuaError::report(L);
 			return false;
 		}
 		return true;
@@ -82,6 +125,53 @@ public:
 private:
     /** The wrapped lua state. **/
     lua_State * state;
+    /** The allocator the state uses, if any. */
+    LuaAllocator * allocator;
+    /** Whether the allocator is deleted along with the state. */
+    bool ownsAllocator;
+    
+    LuaState(const LuaState &);
+    LuaState & operator=(const LuaState &);
+    
+    /** Registry key of the bytecode cache. */
+    static void * bytecodeKey()
+    {
+        static char key;
+        return &key;
+    }
+    
+    /** Opens a new Lua state with the given allocation function. */
+    void open(lua_Alloc f, void * ud)
+    {
+        //Open a new lua state.
+        state = lua_newstate(f, ud);
+        if (!state) {
+            std::cerr << "objlua: *** unable to open new lua state\n";
+            return;
+        }
+        
+        //Register the basic panic fallback.
+        lua_atpanic(state, lua_panic);
+		
+		//Register helper functions.
+		lua_register(state, "dumpStack", lua_dumpStack);
+		lua_register(state, "dump", lua_dump);
+#ifdef OBJLUA_METRICS
+		lua_register(state, "metrics", LuaMetrics::lua_metrics);
+#endif
+        
+        //Load the default libraries.
+        luaL_openlibs(state);
+		
+		//Look for scripts embedded into the binary before touching the disk.
+		LuaEmbedded::install(state);
+		
+		//Reset the stack so we get a clean working area.
+		lua_settop(state, 0);
+		
+		//Register the stacktrace function which may be used as an error function for Lua errors.
+		lua_register(state, "stacktrace", stacktrace);
+    }
     
     /** Basic panic function which functions as a last resort for Lua panics
      that aren't caught by regular code. */
@@ -111,7 +201,8 @@ private:
 	static int lua_dump(lua_State * L)
 	{
 		int top = lua_gettop(L);
-		std::cout << LuaDescribe::generic(L, lua_type(L, top), top) << "\n";
+		LuaDescribe::write(std::cout, L, top);
+		std::cout << "\n";
 		return 0;
 	}
 };
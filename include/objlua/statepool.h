@@ -0,0 +1,299 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "lua.h"
+#include "state.h"
+
+
+/** Runs scripts on several cores by keeping a number of independent Lua
+ states, each of which is driven by a thread of its own. All states are set
+ up by the same function, which typically installs LuaClass, exposes the C++
+ classes and loads the class scripts.
+ 
+ Work is submitted as jobs, which are functions called with the state they
+ run in. Jobs that may run in any state are queued with a worker and stolen by
+ idle workers when their own queue runs dry. Objects live in the state they
+ were created in, so jobs dealing with a particular object have to be pinned
+ to that state; pinned jobs are never stolen.
+ 
+ @code
+ LuaStatePool pool(4, [](LuaState & L) {
+	 LuaClass::install(L);
+	 Sprite::expose(L);
+ });
+ pool.submit([](LuaState & L) { L.dofile("scripts/simulate.lua"); });
+ pool.submit(sprite->getState(), [=](LuaState & L) { sprite->animate(); });
+ pool.wait();
+ @endcode
+ 
+ A state must only be used by jobs while the pool is running, never by other
+ threads. */
+class LuaStatePool {
+public:
+	/** Function setting up a newly created state. */
+	typedef std::function<void (LuaState &)> Setup;
+	/** Function run in one of the states. */
+	typedef std::function<void (LuaState &)> Job;
+	
+	/** Statistics of a single worker. */
+	struct Stats {
+		/** Number of jobs the worker ran. */
+		size_t executed;
+		/** Number of those jobs taken from other workers. */
+		size_t stolen;
+	};
+	
+	/** Creates the given number of states, one per hardware thread if 0, sets
+	 each up and starts their workers. */
+	LuaStatePool(size_t count, const Setup & setup) : stealable(0), unfinished(0), next(0), stopping(false)
+	{
+		if (count == 0)
+			count = std::thread::hardware_concurrency();
+		if (count == 0)
+			count = 1;
+		
+		for (size_t i = 0; i < count; i++) {
+			Worker * worker = new Worker;
+			worker->state = new LuaState;
+			worker->pinnedCount = 0;
+			worker->executed = 0;
+			worker->stolen = 0;
+			worker->registry = lua_topointer(*worker->state, LUA_REGISTRYINDEX);
+			if (setup)
+				setup(*worker->state);
+			workers.push_back(worker);
+		}
+		for (size_t i = 0; i < count; i++)
+			workers[i]->thread = std::thread(&LuaStatePool::run, this, i);
+	}
+	
+	/** Finishes the outstanding jobs, stops the workers and closes the
+	 states. */
+	~LuaStatePool()
+	{
+		wait();
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		for (size_t i = 0; i < workers.size(); i++) {
+			workers[i]->thread.join();
+			delete workers[i]->state;
+			delete workers[i];
+		}
+	}
+	
+	/** Returns the number of states. */
+	size_t size() const { return workers.size(); }
+	
+	/** Returns the state with the given index. */
+	LuaState & getState(size_t index) { return *workers[index]->state; }
+	
+	/** Returns the index of the given state, or -1 if it is not part of the
+	 pool. Threads created by coroutines count as the state they belong to.
+	 Only the registry pointer of L is read, which never changes, so this is
+	 safe while the workers run jobs in their states. */
+	int indexOf(lua_State * L) const
+	{
+		const void * registry = lua_topointer(L, LUA_REGISTRYINDEX);
+		for (size_t i = 0; i < workers.size(); i++)
+			if (workers[i]->registry == registry)
+				return (int)i;
+		return -1;
+	}
+	
+	/** Returns the statistics of the worker driving the given state. */
+	Stats getStats(size_t index) const
+	{
+		Stats s;
+		s.executed = workers[index]->executed;
+		s.stolen = workers[index]->stolen;
+		return s;
+	}
+	
+	/** Submits a job which may run in any state. Jobs submitted from within a
+	 job are queued with the current worker. */
+	void submit(const Job & job)
+	{
+		size_t index = (current >= 0 && currentPool == this ? (size_t)current :
+						next++ % workers.size());
+		Worker * worker = workers[index];
+		unfinished++;
+		stealable++;
+		{
+			std::lock_guard<std::mutex> lock(worker->mutex);
+			worker->jobs.push_back(job);
+		}
+		notify();
+	}
+	
+	/** Submits a job which has to run in the state with the given index. */
+	void submit(size_t index, const Job & job)
+	{
+		Worker * worker = workers[index];
+		unfinished++;
+		worker->pinnedCount++;
+		{
+			std::lock_guard<std::mutex> lock(worker->mutex);
+			worker->pinned.push_back(job);
+		}
+		notify();
+	}
+	
+	/** Submits a job which has to run in the given state, e.g. the state an
+	 object lives in. */
+	void submit(lua_State * L, const Job & job)
+	{
+		int index = indexOf(L);
+		if (index < 0) {
+			std::cerr << "objlua: *** Unable to submit job, state is not part of"
+			" the pool.\n";
+			return;
+		}
+		submit((size_t)index, job);
+	}
+	
+	/** Blocks until all submitted jobs have finished. Must not be called from
+	 within a job. */
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		done.wait(lock, [this] { return unfinished == 0; });
+	}
+	
+private:
+	LuaStatePool(const LuaStatePool &);
+	LuaStatePool & operator=(const LuaStatePool &);
+	
+	struct Worker {
+		LuaState * state;
+		/** Registry of the state, which identifies the state and its threads
+		 without touching them. */
+		const void * registry;
+		std::thread thread;
+		/** Guards the job queues. */
+		std::mutex mutex;
+		/** Jobs which may be stolen by other workers. The worker takes jobs from
+		 the back, thieves from the front. */
+		std::deque<Job> jobs;
+		/** Jobs which have to run in this worker's state. */
+		std::deque<Job> pinned;
+		std::atomic<size_t> pinnedCount;
+		std::atomic<size_t> executed;
+		std::atomic<size_t> stolen;
+	};
+	
+	std::vector<Worker *> workers;
+	/** Number of queued jobs which may be stolen. */
+	std::atomic<size_t> stealable;
+	/** Number of submitted jobs which have not finished yet. */
+	std::atomic<size_t> unfinished;
+	/** Worker the next job submitted from outside the pool is queued with. */
+	std::atomic<size_t> next;
+	bool stopping;
+	/** Guards sleeping and waking up of workers and waiting threads. */
+	std::mutex sleepMutex;
+	std::condition_variable wakeup;
+	std::condition_variable done;
+	
+	/** Index of the worker running on the current thread, and its pool. */
+	static inline thread_local int current = -1;
+	static inline thread_local LuaStatePool * currentPool = NULL;
+	
+	/** Wakes up idle workers after a job was queued. */
+	void notify()
+	{
+		//Taking the lock ensures no worker is between checking for jobs and
+		//going to sleep.
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+		}
+		wakeup.notify_all();
+	}
+	
+	/** Takes a job from the queues of the worker with the given index. */
+	bool take(size_t index, Job & job)
+	{
+		Worker * worker = workers[index];
+		std::lock_guard<std::mutex> lock(worker->mutex);
+		if (!worker->pinned.empty()) {
+			job.swap(worker->pinned.front());
+			worker->pinned.pop_front();
+			worker->pinnedCount--;
+			return true;
+		}
+		if (!worker->jobs.empty()) {
+			job.swap(worker->jobs.back());
+			worker->jobs.pop_back();
+			stealable--;
+			return true;
+		}
+		return false;
+	}
+	
+	/** Steals a job from one of the other workers. */
+	bool steal(size_t index, Job & job)
+	{
+		for (size_t i = 1; i < workers.size() && stealable > 0; i++) {
+			Worker * victim = workers[(index + i) % workers.size()];
+			std::lock_guard<std::mutex> lock(victim->mutex);
+			if (!victim->jobs.empty()) {
+				job.swap(victim->jobs.front());
+				victim->jobs.pop_front();
+				stealable--;
+				return true;
+			}
+		}
+		return false;
+	}
+	
+	/** Main loop of the worker with the given index. */
+	void run(size_t index)
+	{
+		current = (int)index;
+		currentPool = this;
+		Worker * worker = workers[index];
+		
+		for (;;) {
+			Job job;
+			bool stolen = false;
+			if (!take(index, job))
+				stolen = steal(index, job);
+			
+			if (job) {
+				try {
+					job(*worker->state);
+				} catch (std::exception & e) {
+					std::cerr << "objlua: *** Job in state " << index << " threw: " << e.what() << "\n";
+				}
+				worker->executed++;
+				if (stolen)
+					worker->stolen++;
+				if (--unfinished == 0) {
+					std::lock_guard<std::mutex> lock(sleepMutex);
+					done.notify_all();
+				}
+				continue;
+			}
+			
+			//Sleep until there is something to do.
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			wakeup.wait(lock, [this, worker] {
+				return stopping || stealable > 0 || worker->pinnedCount > 0;
+			});
+			if (stopping && stealable == 0 && worker->pinnedCount == 0)
+				break;
+		}
+		
+		current = -1;
+		currentPool = NULL;
+	}
+};
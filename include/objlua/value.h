@@ -0,0 +1,170 @@
+#pragma once
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "lua.h"
+
+
+/** Describes how a C++ type is moved between the Lua stack and C++. Each
+ specialization provides a static push function which pushes a value onto the
+ stack, a static get function which reads the value at the given index
+ without popping it, and a static check function which does the same but
+ raises a Lua error if the value cannot be read as the type. The specialization
+ is picked at compile time, so calls built from these reduce to plain
+ lua_push* and lua_to* sequences. */
+template <typename T, typename Enable = void> struct LuaValue;
+
+/** Booleans. */
+template <> struct LuaValue<bool> {
+	static void push(lua_State * L, bool value) { lua_pushboolean(L, value); }
+	static bool get(lua_State * L, int index) { return lua_toboolean(L, index); }
+	static bool check(lua_State * L, int index) { return lua_toboolean(L, index); }
+};
+
+/** Integers of any width, passed through lua_Integer. */
+template <typename T>
+struct LuaValue<T, typename std::enable_if<std::is_integral<T>::value &&
+	!std::is_same<T, bool>::value>::type> {
+	static void push(lua_State * L, T value) { lua_pushinteger(L, (lua_Integer)value); }
+	static T get(lua_State * L, int index) { return (T)lua_tointeger(L, index); }
+	static T check(lua_State * L, int index) { return (T)luaL_checkinteger(L, index); }
+};
+
+/** Floating point numbers, passed through lua_Number. */
+template <typename T>
+struct LuaValue<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+	static void push(lua_State * L, T value) { lua_pushnumber(L, (lua_Number)value); }
+	static T get(lua_State * L, int index) { return (T)lua_tonumber(L, index); }
+	static T check(lua_State * L, int index) { return (T)luaL_checknumber(L, index); }
+};
+
+/** C strings. A NULL pointer is pushed as nil. Strings read from the stack are
+ only valid as long as the value remains on the stack. */
+template <> struct LuaValue<const char *> {
+	static void push(lua_State * L, const char * value)
+	{
+		if (value)
+			lua_pushstring(L, value);
+		else
+			lua_pushnil(L);
+	}
+	static const char * get(lua_State * L, int index) { return lua_tostring(L, index); }
+	static const char * check(lua_State * L, int index)
+	{
+		return (lua_isnoneornil(L, index) ? NULL : luaL_checkstring(L, index));
+	}
+};
+template <> struct LuaValue<char *> : LuaValue<const char *> {};
+
+/** Standard strings, pushed with their explicit length. */
+template <> struct LuaValue<std::string> {
+	static void push(lua_State * L, const std::string & value)
+	{
+		lua_pushlstring(L, value.data(), value.size());
+	}
+	static std::string get(lua_State * L, int index)
+	{
+		size_t length = 0;
+		const char * s = lua_tolstring(L, index, &length);
+		return (s ? std::string(s, length) : std::string());
+	}
+	static std::string check(lua_State * L, int index)
+	{
+		size_t length = 0;
+		const char * s = luaL_checklstring(L, index, &length);
+		return std::string(s, length);
+	}
+};
+
+/** String views, pushed with their explicit length. Views read from the stack
+ are only valid as long as the value remains on the stack. */
+template <> struct LuaValue<std::string_view> {
+	static void push(lua_State * L, std::string_view value)
+	{
+		lua_pushlstring(L, value.data(), value.size());
+	}
+	static std::string_view get(lua_State * L, int index)
+	{
+		size_t length = 0;
+		const char * s = lua_tolstring(L, index, &length);
+		return (s ? std::string_view(s, length) : std::string_view());
+	}
+	static std::string_view check(lua_State * L, int index)
+	{
+		size_t length = 0;
+		const char * s = luaL_checklstring(L, index, &length);
+		return std::string_view(s, length);
+	}
+};
+
+/** Detects exposed objects, i.e. classes derived from LuaExposable. */
+template <typename T, typename Enable = void>
+struct LuaIsExposable : std::false_type {};
+template <typename T>
+struct LuaIsExposable<T, decltype(std::declval<T &>().loadReference(), void())>
+	: std::true_type {};
+
+/** Pointers to exposed objects. NULL is pushed as nil, anything that is not an
+ instance of T reads as NULL. */
+template <typename T>
+struct LuaValue<T *, typename std::enable_if<LuaIsExposable<T>::value>::type> {
+	static void push(lua_State * L, T * value)
+	{
+		if (value)
+			value->loadReference();
+		else
+			lua_pushnil(L);
+	}
+	static T * get(lua_State * L, int index)
+	{
+		return T::toObject(L, index);
+	}
+	static T * check(lua_State * L, int index)
+	{
+		if (lua_isnoneornil(L, index))
+			return NULL;
+		T * value = get(L, index);
+		if (!value)
+			luaL_argerror(L, index, "instance of the exposed class expected");
+		return value;
+	}
+};
+
+
+/** Describes what a call expecting the return types R... produces. Calls with-
+ out return values yield a bool indicating success, calls with a single return
+ value an optional of that value, and calls with multiple return values an
+ optional tuple. */
+template <typename... R> struct LuaReturn {
+	typedef std::optional<std::tuple<R...> > type;
+	static type failure() { return std::nullopt; }
+
+	/** Reads the return values, the first of which is at the given index. */
+	static type pull(lua_State * L, int first)
+	{
+		return pull(L, first, std::index_sequence_for<R...>());
+	}
+
+private:
+	template <size_t... I>
+	static type pull(lua_State * L, int first, std::index_sequence<I...>)
+	{
+		//The braced initializer guarantees left-to-right evaluation.
+		return std::tuple<R...>{LuaValue<R>::get(L, first + (int)I)...};
+	}
+};
+
+template <typename R> struct LuaReturn<R> {
+	typedef std::optional<R> type;
+	static type failure() { return std::nullopt; }
+	static type pull(lua_State * L, int first) { return LuaValue<R>::get(L, first); }
+};
+
+template <> struct LuaReturn<> {
+	typedef bool type;
+	static type failure() { return false; }
+	static type pull(lua_State * L, int first) { return true; }
+};
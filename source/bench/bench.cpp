@@ -0,0 +1,402 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <objlua/objlua.h>
+
+using namespace std;
+
+
+/** Outcome of a single benchmark. */
+struct Result {
+	string name;
+	long ops;
+	double ns;
+	double allocations;
+	double bytes;
+};
+
+/** Scale of the number of operations per benchmark, set by --quick. */
+static double scale = 1;
+
+/** Runs the given function, which performs the given number of operations in
+ the state allocating through the given allocator, and returns the time and
+ Lua allocations per operation. A tenth of the operations are run before as a
+ warm-up. */
+static Result measure(const char * name, LuaAllocator & allocator, long ops,
+					  const function<void (long)> & f)
+{
+	ops = (long)(ops * scale);
+	if (ops < 1)
+		ops = 1;
+	f(ops / 10 + 1);
+	
+	LuaAllocator::Stats before = allocator.getStats();
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	f(ops);
+	chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+	LuaAllocator::Stats after = allocator.getStats();
+	
+	Result r;
+	r.name = name;
+	r.ops = ops;
+	r.ns = elapsed.count() / ops;
+	r.allocations = (double)(after.allocations - before.allocations) / ops;
+	r.bytes = (double)(after.allocated - before.allocated) / ops;
+	return r;
+}
+
+/** Runs the given Lua loop, which receives the number of operations as its
+ argument. */
+static function<void (long)> loop(lua_State * L, const char * code)
+{
+	return [=](long ops) {
+		if (luaL_loadstring(L, code) != 0) {
+			LuaError::report(L);
+			return;
+		}
+		lua_pushinteger(L, ops);
+		if (lua_pcall(L, 1, 0, 0) != 0)
+			LuaError::report(L);
+	};
+}
+
+
+/** Exposed class the benchmarks call into and instantiate. */
+class Bench : public LuaExposable<Bench> {
+public:
+	OBJLUA_CONSTRUCTOR(Bench) {}
+	
+	static void expose(lua_State * L)
+	{
+		LuaClass::make(L, "Bench");
+		LuaExposable<Bench>::expose(L);
+		static const luaL_Reg functions[] = {
+			{"add", lua_add},
+			{"bound", OBJLUA_METHOD(&Bench::add)},
+			{NULL, NULL}
+		};
+		luaL_register(L, 0, functions);
+		lua_pop(L, 1);
+		luaL_dostring(L, "function Bench:f0() end\n"
+					  "function Bench:f1(a) end\n"
+					  "function Bench:f4(a, b, c, d) end");
+	}
+	
+	double add(double a) { return total += a; }
+	
+	/** Hand-written thunk resolving the object through fromStack. */
+	static int lua_add(lua_State * L)
+	{
+		Bench * self = fromStack(L, 1);
+		lua_pushnumber(L, self->add(luaL_checknumber(L, 2)));
+		return 1;
+	}
+	
+	double total = 0;
+};
+
+
+/** C++ to Lua calls through callFunction with 0, 1 and 4 arguments, and calls
+ of a missing method. */
+static void benchCalls(vector<Result> & results)
+{
+	LuaHeapAllocator heap;
+	LuaState L(heap);
+	LuaClass::install(L);
+	Bench::expose(L);
+	Bench * b = new Bench(L);
+	b->constructLua("Bench");
+	
+	results.push_back(measure("call/0", heap, 1000000, [=](long ops) {
+		for (long i = 0; i < ops; i++)
+			b->callFunction("f0");
+	}));
+	results.push_back(measure("call/1", heap, 1000000, [=](long ops) {
+		for (long i = 0; i < ops; i++)
+			b->callFunction("f1", "n", 1, 1.0);
+	}));
+	results.push_back(measure("call/4", heap, 1000000, [=](long ops) {
+		for (long i = 0; i < ops; i++)
+			b->callFunction("f4", "nnnn", 0, 1.0, 2.0, 3.0, 4.0);
+	}));
+	
+	//Optional hooks the class does not implement, by name and through the
+	//presence cache.
+	static const LuaHook missing("missing");
+	results.push_back(measure("call/missing", heap, 1000000, [=](long ops) {
+		for (long i = 0; i < ops; i++)
+			b->call("missing", 1.0);
+	}));
+	results.push_back(measure("call/missing-hook", heap, 1000000, [=](long ops) {
+		for (long i = 0; i < ops; i++)
+			b->call(missing, 1.0);
+	}));
+	delete b;
+}
+
+/** Lua to C++ calls of a hand-written method using fromStack, and of the same
+ method bound through OBJLUA_METHOD. */
+static void benchMethods(vector<Result> & results)
+{
+	LuaHeapAllocator heap;
+	LuaState L(heap);
+	LuaClass::install(L);
+	Bench::expose(L);
+	luaL_dostring(L, "bench = Bench:new()");
+	
+	results.push_back(measure("method/fromStack", heap, 3000000,
+		loop(L, "local o = bench for i = 1, ... do o:add(1) end")));
+	results.push_back(measure("method/bound", heap, 3000000,
+		loop(L, "local o = bench for i = 1, ... do o:bound(1) end")));
+}
+
+/** Creation of objects through constructLua and their deletion. */
+static void benchObjects(vector<Result> & results)
+{
+	LuaHeapAllocator heap;
+	LuaState L(heap);
+	LuaClass::install(L);
+	Bench::expose(L);
+	
+	results.push_back(measure("object/new+delete", heap, 300000,
+		loop(L, "for i = 1, ... do Bench:new():delete() end")));
+}
+
+/** Calls of a method defined at the root of class hierarchies of several
+ depths. */
+static void benchDispatch(vector<Result> & results)
+{
+	static const int depths[] = {1, 4, 16};
+	for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+		LuaHeapAllocator heap;
+		LuaState L(heap);
+		LuaClass::install(L);
+		LuaClass::make(L, "Level0");
+		lua_pop(L, 1);
+		luaL_dostring(L, "function Level0:m() end");
+		char name[32], super[32];
+		for (int i = 1; i < depths[d]; i++) {
+			snprintf(name, sizeof(name), "Level%d", i);
+			snprintf(super, sizeof(super), "Level%d", i - 1);
+			LuaClass::make(L, name, super);
+			lua_pop(L, 1);
+		}
+		char source[64];
+		snprintf(source, sizeof(source), "obj = setmetatable({}, Level%d)", depths[d] - 1);
+		luaL_dostring(L, source);
+		
+		snprintf(name, sizeof(name), "dispatch/depth%d", depths[d]);
+		results.push_back(measure(name, heap, 3000000,
+			loop(L, "local o = obj for i = 1, ... do o:m() end")));
+	}
+}
+
+/** Description of a table with 10000 entries. */
+static void benchDescribe(vector<Result> & results)
+{
+	LuaHeapAllocator heap;
+	LuaState L(heap);
+	luaL_dostring(L, "t = {} for i = 1, 10000 do t['key' .. i] = {i, 'value'} end");
+	lua_getglobal(L, "t");
+	
+	results.push_back(measure("describe/10000", heap, 50, [&](long ops) {
+		for (long i = 0; i < ops; i++) {
+			string s;
+			LuaDescribe::write(s, L, -1);
+		}
+	}));
+}
+
+/** Creation of a state which loads a class script. */
+static void benchStartup(vector<Result> & results)
+{
+	char path[] = "/tmp/objlua-bench-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return;
+	string script = "class('Startup')\n";
+	for (int i = 0; i < 200; i++) {
+		char line[128];
+		snprintf(line, sizeof(line), "function Startup:m%d(a, b) return a + b * %d end\n", i, i);
+		script += line;
+	}
+	if (write(fd, script.data(), script.size()) != (ssize_t)script.size())
+		fprintf(stderr, "Unable to write %s\n", path);
+	close(fd);
+	
+	LuaHeapAllocator heap;
+	results.push_back(measure("dofile/startup", heap, 2000, [&](long ops) {
+		for (long i = 0; i < ops; i++) {
+			LuaState L(heap);
+			LuaClass::install(L);
+			L.dofile(path);
+		}
+	}));
+	unlink(path);
+}
+
+
+/** Writes the results as JSON. */
+static void writeJSON(FILE * f, const vector<Result> & results)
+{
+	fprintf(f, "{\n\t\"benchmarks\": [\n");
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result & r = results[i];
+		fprintf(f, "\t\t{\"name\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.2f, "
+				"\"allocs_per_op\": %.3f, \"bytes_per_op\": %.1f}%s\n",
+				r.name.c_str(), r.ops, r.ns, r.allocations, r.bytes,
+				(i + 1 < results.size() ? "," : ""));
+	}
+	fprintf(f, "\t]\n}\n");
+}
+
+/** Returns the number following the given key in the JSON object at p. */
+static double field(const char * p, const char * key)
+{
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+	const char * end = strchr(p, '}');
+	const char * q = strstr(p, pattern);
+	if (!q || (end && q > end))
+		return 0;
+	return strtod(q + strlen(pattern), NULL);
+}
+
+/** Reads the results written by writeJSON. */
+static bool readJSON(const char * path, vector<Result> & results)
+{
+	FILE * f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Unable to read %s\n", path);
+		return false;
+	}
+	string json;
+	char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+		json.append(buffer, n);
+	fclose(f);
+	
+	const char * p = json.c_str();
+	while ((p = strstr(p, "{\"name\": \"")) != NULL) {
+		p += 10;
+		const char * quote = strchr(p, '"');
+		if (!quote)
+			break;
+		Result r;
+		r.name.assign(p, quote - p);
+		r.ops = (long)field(quote, "ops");
+		r.ns = field(quote, "ns_per_op");
+		r.allocations = field(quote, "allocs_per_op");
+		r.bytes = field(quote, "bytes_per_op");
+		results.push_back(r);
+		p = quote;
+	}
+	return true;
+}
+
+/** Returns the relative change from a to b in percent. */
+static double change(double a, double b)
+{
+	return (a != 0 ? (b - a) / a * 100 : 0);
+}
+
+/** Prints the changes between two result files. */
+static int compare(const char * basePath, const char * newPath)
+{
+	vector<Result> base, current;
+	if (!readJSON(basePath, base) || !readJSON(newPath, current))
+		return 1;
+	map<string, const Result *> byName;
+	for (size_t i = 0; i < base.size(); i++)
+		byName[base[i].name] = &base[i];
+	
+	printf("%-20s %12s %12s %8s  %10s %10s\n", "benchmark", "base ns/op", "ns/op",
+		   "change", "allocs/op", "bytes/op");
+	for (size_t i = 0; i < current.size(); i++) {
+		const Result & r = current[i];
+		map<string, const Result *>::iterator it = byName.find(r.name);
+		if (it == byName.end()) {
+			printf("%-20s %12s %12.1f %8s  %10.2f %10.1f\n", r.name.c_str(), "-",
+				   r.ns, "new", r.allocations, r.bytes);
+			continue;
+		}
+		const Result & b = *it->second;
+		printf("%-20s %12.1f %12.1f %+7.1f%%  %+10.2f %+10.1f\n", r.name.c_str(),
+			   b.ns, r.ns, change(b.ns, r.ns), r.allocations - b.allocations,
+			   r.bytes - b.bytes);
+		byName.erase(it);
+	}
+	for (map<string, const Result *>::iterator it = byName.begin(); it != byName.end(); ++it)
+		printf("%-20s %12.1f %12s %8s\n", it->first.c_str(), it->second->ns, "-", "removed");
+	return 0;
+}
+
+static void usage(const char * program)
+{
+	fprintf(stderr, "usage: %s [--quick] [--json file] [filter]\n"
+			"       %s --compare base.json new.json\n", program, program);
+}
+
+
+int main(int argc, char * argv[])
+{
+	const char * json = NULL;
+	const char * filter = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--compare") == 0 && i + 2 < argc) {
+			return compare(argv[i + 1], argv[i + 2]);
+		} else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+			json = argv[++i];
+		} else if (strcmp(argv[i], "--quick") == 0) {
+			scale = 0.1;
+		} else if (argv[i][0] == '-') {
+			usage(argv[0]);
+			return 1;
+		} else {
+			filter = argv[i];
+		}
+	}
+	
+	//Run the benchmarks whose group matches the filter.
+	static const struct {
+		const char * name;
+		void (*run)(vector<Result> &);
+	} groups[] = {
+		{"call", benchCalls},
+		{"method", benchMethods},
+		{"object", benchObjects},
+		{"dispatch", benchDispatch},
+		{"describe", benchDescribe},
+		{"dofile", benchStartup}
+	};
+	vector<Result> results;
+	for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); i++)
+		if (!filter || strstr(groups[i].name, filter))
+			groups[i].run(results);
+	
+	printf("%-20s %10s %12s %10s %10s\n", "benchmark", "ops", "ns/op", "allocs/op", "bytes/op");
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result & r = results[i];
+		printf("%-20s %10ld %12.1f %10.2f %10.1f\n", r.name.c_str(), r.ops, r.ns,
+			   r.allocations, r.bytes);
+	}
+	
+	if (json) {
+		FILE * f = (strcmp(json, "-") == 0 ? stdout : fopen(json, "w"));
+		if (!f) {
+			fprintf(stderr, "Unable to write %s\n", json);
+			return 1;
+		}
+		writeJSON(f, results);
+		if (f != stdout)
+			fclose(f);
+	}
+	return 0;
+}
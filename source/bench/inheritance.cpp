@@ -0,0 +1,83 @@
+#include <chrono>
+#include <cstdio>
+#include <objlua/objlua.h>
+
+using namespace std;
+
+
+/** Number of method calls per measurement. */
+static const int CALLS = 1000000;
+
+/** Builds a class hierarchy of the given depth, whose root class defines the
+ method m, and leaves an instance of the deepest class in the global obj and a
+ registry reference to it in ref. */
+static int buildHierarchy(lua_State * L, int depth)
+{
+	char name[32], super[32];
+	LuaClass::make(L, "Level0");
+	lua_pop(L, 1);
+	luaL_dostring(L, "function Level0:m() return 1 end");
+	for (int i = 1; i < depth; i++) {
+		snprintf(name, sizeof(name), "Level%d", i);
+		snprintf(super, sizeof(super), "Level%d", i - 1);
+		LuaClass::make(L, name, super);
+		lua_pop(L, 1);
+	}
+	
+	char source[64];
+	snprintf(source, sizeof(source), "obj = setmetatable({}, Level%d)", depth - 1);
+	luaL_dostring(L, source);
+	lua_getglobal(L, "obj");
+	return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/** Returns the nanoseconds per call of calling the method from Lua. */
+static double measureLua(lua_State * L)
+{
+	luaL_loadstring(L, "local o = obj for i = 1, ... do o:m() end");
+	lua_pushinteger(L, CALLS);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	lua_call(L, 1, 0);
+	chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+	return elapsed.count() / CALLS;
+}
+
+/** Returns the nanoseconds per call of calling the method from C++. */
+static double measureCpp(lua_State * L, int ref)
+{
+	const int calls = CALLS / 10;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int i = 0; i < calls; i++)
+		Lua::call(L, "m", ref);
+	chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+	return elapsed.count() / calls;
+}
+
+
+int main(int argc, char * argv[])
+{
+	static const int depths[] = {1, 2, 4, 8, 16, 32};
+	
+	printf("%6s  %14s %14s  %14s %14s\n", "depth", "lua ns/call", "flat",
+		   "c++ ns/call", "flat");
+	for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+		LuaState lua;
+		LuaClass::install(lua);
+		int ref = buildHierarchy(lua, depths[i]);
+		
+		double lua0 = measureLua(lua);
+		double cpp0 = measureCpp(lua, ref);
+		
+		lua_getglobal(lua, "Level0");
+		LuaClass::flatten(lua, -1);
+		lua_pop(lua, 1);
+		
+		double lua1 = measureLua(lua);
+		double cpp1 = measureCpp(lua, ref);
+		
+		printf("%6d  %14.1f %14.1f  %14.1f %14.1f\n", depths[i], lua0, lua1,
+			   cpp0, cpp1);
+	}
+	
+	return 0;
+}
@@ -0,0 +1,96 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <objlua/objlua.h>
+
+using namespace std;
+
+
+/** Number of encodings and decodings per measurement. */
+static const int RUNS = 50;
+
+/** Exposed class with a numeric property, used to check that snapshots
+ assigning it a value of the wrong type are rejected. */
+class Item : public LuaExposable<Item> {
+public:
+	OBJLUA_CONSTRUCTOR(Item), count(0) {}
+	
+	static void expose(lua_State * L)
+	{
+		LuaClass::make(L, "Item");
+		LuaExposable<Item>::expose(L);
+		OBJLUA_PROPERTY(count, &Item::count);
+		lua_pop(L, 1);
+	}
+	
+	int count;
+};
+
+/** Builds a world of nested tables and class instances in the global world,
+ resembling the script state of a game. */
+static void buildWorld(lua_State * L)
+{
+	LuaClass::install(L);
+	LuaClass::make(L, "Entity");
+	lua_pop(L, 1);
+	luaL_dostring(L, "world = {entities = {}, names = {}}\n"
+				  "for i = 1, 10000 do\n"
+				  "	local e = setmetatable({id = i, x = i * 0.5, y = -i, alive = true,\n"
+				  "		name = 'entity' .. i, tags = {'a', 'b', 'c'}}, Entity)\n"
+				  "	world.entities[i] = e\n"
+				  "	world.names[e.name] = e\n"
+				  "end");
+	lua_getglobal(L, "world");
+}
+
+/** Returns the megabytes per second of the given function, which processes
+ the given number of bytes. */
+template <typename F>
+static double measure(size_t bytes, F f)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int i = 0; i < RUNS; i++)
+		f();
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	return bytes * RUNS / elapsed.count() / 1e6;
+}
+
+
+int main(int argc, char * argv[])
+{
+	LuaState L;
+	buildWorld(L);
+	
+	//The text dump is the only other way to serialize the world.
+	string text;
+	LuaDescribe::write(text, L, -1, LuaDescribe::Limits(16, (size_t)-1, (size_t)-1));
+	double dump = measure(text.size(), [&] {
+		string s;
+		LuaDescribe::write(s, L, -1, LuaDescribe::Limits(16, (size_t)-1, (size_t)-1));
+	});
+	
+	string data;
+	LuaSnapshot::encode(L, -1, data);
+	double encode = measure(data.size(), [&] {
+		string s;
+		LuaSnapshot::encode(L, -1, s);
+	});
+	double decode = measure(data.size(), [&] {
+		LuaSnapshot::decode(L, data.data(), data.size());
+		lua_pop(L, 1);
+	});
+	
+	printf("%-16s %10s %10s\n", "", "bytes", "MB/s");
+	printf("%-16s %10zu %10.1f\n", "text dump", text.size(), dump);
+	printf("%-16s %10zu %10.1f\n", "snapshot encode", data.size(), encode);
+	printf("%-16s %10zu %10.1f\n", "snapshot decode", data.size(), decode);
+	
+	//An item whose count is a string, as saved before the property became a
+	//number, must fail to decode rather than abort.
+	lua_settop(L, 0);
+	Item::expose(L);
+	static const char malformed[] = "OLSN\x01\xc7\x01\xa4Item\0\0\0\x01\xa5" "count\xa4many";
+	bool rejected = !LuaSnapshot::decode(L, malformed, sizeof(malformed) - 1);
+	printf("malformed snapshot %s\n", (rejected && lua_gettop(L) == 0 ? "rejected" : "ACCEPTED"));
+	return (rejected ? 0 : 1);
+}
@@ -0,0 +1,91 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include <objlua/objlua.h>
+
+using namespace std;
+
+
+/** Number of jobs per measurement. */
+static const int JOBS = 2000;
+/** Loop iterations of the script each job runs. */
+static const int WORK = 20000;
+
+/** Sets up a state with a class whose method does some busy work, and an
+ instance of it in the global worker. */
+static void setup(LuaState & L)
+{
+	LuaClass::install(L);
+	LuaClass::make(L, "Worker");
+	lua_pop(L, 1);
+	luaL_dostring(L, "function Worker:work(n)\n"
+				  "	local s = 0\n"
+				  "	for i = 1, n do s = s + math.sqrt(i) end\n"
+				  "	return s\n"
+				  "end\n"
+				  "worker = setmetatable({}, Worker)");
+}
+
+/** Calls the worker's method in the given state. */
+static void job(LuaState & L)
+{
+	lua_getglobal(L, "worker");
+	Lua::invokeMethod<double>(L, "work", true, WORK);
+}
+
+/** Returns the jobs per second of a pool with the given number of states.
+ Jobs are either left to the scheduler or pinned to the states round-robin. */
+static double measure(LuaStatePool & pool, bool pinned)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int i = 0; i < JOBS; i++) {
+		if (pinned)
+			pool.submit((size_t)i % pool.size(), job);
+		else
+			pool.submit(job);
+	}
+	pool.wait();
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	return JOBS / elapsed.count();
+}
+
+
+int main(int argc, char * argv[])
+{
+	int cores = (argc > 1 ? atoi(argv[1]) : (int)thread::hardware_concurrency());
+	if (cores < 1)
+		cores = 1;
+	
+	printf("%6s  %14s %8s  %14s %8s  %8s\n", "states", "jobs/s", "speedup",
+		   "pinned jobs/s", "speedup", "stolen");
+	
+	//Measure powers of two and the largest pool.
+	vector<int> sizes;
+	for (int n = 1; n < cores; n *= 2)
+		sizes.push_back(n);
+	sizes.push_back(cores);
+	
+	double base = 0, basePinned = 0;
+	for (size_t s = 0; s < sizes.size(); s++) {
+		int n = sizes[s];
+		LuaStatePool pool(n, setup);
+		measure(pool, false);
+		
+		double free = measure(pool, false);
+		double pinned = measure(pool, true);
+		if (n == 1) {
+			base = free;
+			basePinned = pinned;
+		}
+		
+		size_t stolen = 0;
+		for (size_t i = 0; i < pool.size(); i++)
+			stolen += pool.getStats(i).stolen;
+		printf("%6d  %14.0f %7.2fx  %14.0f %7.2fx  %8zu\n", n, free, free / base,
+			   pinned, pinned / basePinned, stolen);
+	}
+	
+	return 0;
+}
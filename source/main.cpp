@@ -11,15 +11,22 @@ int main(int argc, char * argv[])
     LuaState lua;
 	LuaClass::install(lua);
     
-	//Expose the Sprite class.
-	Sprite::expose(lua);
+	//Load the Sprite classes the first time a script uses them.
+	LuaClass::autoload(lua, "Sprite", Sprite::expose, "scripts/sprite.lua");
+	LuaClass::autoload(lua, "SpecialSprite", NULL, "scripts/sprite.lua");
 	
     //Run a Lua file for debugging purposes.
-	lua.dofile("scripts/debug.lua");
-    
-	//Now the script should actually have returned a Sprite instance.
-	/*Sprite * sprite = Sprite::fromStack<Sprite>(lua, -1);
-	sprite->animate();*/
+	int top = lua_gettop(lua);
+	if (lua.dofile("scripts/debug.lua")) {
+		//Now the script should actually have returned a Sprite instance.
+		Sprite * sprite = Sprite::fromStack(lua, -1);
+		if (sprite)
+			sprite->animate();
+		lua_settop(lua, top);
+	}
+	
+	LuaClass::AutoloadStats stats = LuaClass::getAutoloadStats(lua);
+	cout << stats.materialized << " of " << stats.registered << " classes loaded\n";
     
     return 0;
 }
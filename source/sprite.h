@@ -5,36 +5,38 @@
 using namespace std;
 
 
-class Sprite : public LuaExposable {
+class Sprite : public LuaExposable<Sprite> {
 public:
-	Sprite(lua_State * L, const char * className, bool leaveOnStack = false)
-	: LuaExposable(L, className, leaveOnStack) {}
+	OBJLUA_CONSTRUCTOR(Sprite) {}
 	
-	static void expose(LuaState & L)
+	static void expose(lua_State * L)
 	{
 		//Create the new class.
 		LuaClass::make(L, "Sprite");
 		
 		//Expose the base functions.
-		LuaExposable::expose<Sprite>(L);
+		LuaExposable<Sprite>::expose(L);
+		
+		//Expose the fields.
+		OBJLUA_PROPERTY(name, &Sprite::name);
 		
 		//Register functions.
 		static const luaL_Reg functions[] = {
-			{"say", Sprite::lua_say},
+			{"say", OBJLUA_METHOD(&Sprite::say)},
 			{NULL, NULL}
 		};
 		luaL_register(L, 0, functions);
 		lua_pop(L, 1);
-		
-		//Load the class script file.
-		L.dofile("scripts/sprite.lua");
 	}
 	
-	static int lua_say(lua_State * L)
+	void say()
 	{
 		cout << "Here I am, saying stuff.\n";
-		return 0;
 	}
 	
-	LuaExposable_WrapCallMethod(animate)
+	/** Calls the animate function implemented in Lua. */
+	bool animate() { return call("animate"); }
+	
+	/** The sprite's name, which scripts access as self.name. */
+	std::string name;
 };